@@ -0,0 +1,89 @@
+/* CRC-32 (zip, gzip) by carry-less multiplication folding.
+
+   Same value and calling convention as zlib's crc32_z(). On x86-64 with
+   PCLMULQDQ, checked at run time, 64 bytes are folded per step with the
+   constants of Intel's "Fast CRC Computation for Generic Polynomials Using
+   PCLMULQDQ Instruction", the same kernel Linux uses for crc32_le. Short
+   buffers, the unaligned head and tail, and other targets go to zlib, which
+   uses the ARMv8 CRC instructions itself when they are enabled. Vector code is
+   written with compiler builtins, the intrinsic headers clash with nolibc
+   types. Needs zlib.h */
+#ifndef CRC32FOLD_H
+#define CRC32FOLD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC_PCLMUL
+#define CRC_FOLD_MIN 64 // below this the setup costs more than it saves
+
+typedef long long crc_v2di __attribute__((vector_size(16)));
+typedef int crc_v4si __attribute__((vector_size(16)));
+typedef long long crc_u2di __attribute__((vector_size(16), aligned(1), __may_alias__));
+
+#define CRC_CLMUL( a, b, imm ) __builtin_ia32_pclmulqdq128( a, b, imm )
+
+// one 128-bit lane folded over 16 (k = R4R3) or 64 (k = R2R1) bytes and added to the data at p
+#define CRC_FOLD( x, k, next ) ( CRC_CLMUL( x, k, 0x00 ) ^ CRC_CLMUL( x, k, 0x11 ) ^ ( next ))
+
+// crc is not inverted here, len is a multiple of 16 and at least 64
+__attribute__((target("pclmul,sse2")))
+static uint32_t S_Crc32Fold( uint32_t crc, const unsigned char *buf, size_t len )
+{
+	const crc_v2di r2r1 = { 0x154442bd4LL, 0x1c6e41596LL };
+	const crc_v2di r4r3 = { 0x1751997d0LL, 0x0ccaa009eLL };
+	const crc_v2di r5 = { 0x163cd6124LL, 0 };
+	const crc_v2di rupoly = { 0x1db710641LL, 0x1f7011641LL }; // P' and u' of the Barrett reduction
+	const crc_v2di mask32 = { 0xffffffffLL, 0 };
+	const crc_u2di *p = (const crc_u2di *)buf;
+	crc_v2di x1 = p[0], x2 = p[1], x3 = p[2], x4 = p[3], t;
+
+	x1 ^= (crc_v2di){ crc, 0 };
+	for( p += 4, len -= 64; len >= 64; p += 4, len -= 64 )
+	{
+		x1 = CRC_FOLD( x1, r2r1, p[0] );
+		x2 = CRC_FOLD( x2, r2r1, p[1] );
+		x3 = CRC_FOLD( x3, r2r1, p[2] );
+		x4 = CRC_FOLD( x4, r2r1, p[3] );
+	}
+	x1 = CRC_FOLD( x1, r4r3, x2 );
+	x1 = CRC_FOLD( x1, r4r3, x3 );
+	x1 = CRC_FOLD( x1, r4r3, x4 );
+	for( ; len >= 16; p++, len -= 16 )
+		x1 = CRC_FOLD( x1, r4r3, p[0] );
+
+	// 128 to 64 bits, then 64 to 32, then the Barrett reduction
+	x1 = CRC_CLMUL( r4r3, x1, 0x01 ) ^ (crc_v2di){ x1[1], 0 };
+	t = (crc_v2di)(crc_v4si){ ((crc_v4si)x1)[1], ((crc_v4si)x1)[2], ((crc_v4si)x1)[3], 0 };
+	x1 = CRC_CLMUL( x1 & mask32, r5, 0x00 ) ^ t;
+	t = x1;
+	x1 = CRC_CLMUL( x1 & mask32, rupoly, 0x10 );
+	x1 = CRC_CLMUL( x1 & mask32, rupoly, 0x00 ) ^ t;
+	return ((crc_v4si)x1)[1];
+}
+#endif
+
+static uint32_t S_Crc32( uint32_t crc, const unsigned char *buf, size_t len )
+{
+#ifdef CRC_PCLMUL
+	if( len >= CRC_FOLD_MIN && __builtin_cpu_supports( "pclmul" ))
+	{
+		size_t head = -(uintptr_t)buf & 15, body;
+
+		crc = crc32_z( crc, buf, head );
+		buf += head;
+		len -= head;
+		if( len >= CRC_FOLD_MIN )
+		{
+			body = len & ~(size_t)15;
+			crc = ~S_Crc32Fold( ~crc, buf, body );
+			buf += body;
+			len -= body;
+		}
+	}
+#endif
+	return crc32_z( crc, buf, len );
+}
+
+#endif
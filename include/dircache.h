@@ -0,0 +1,134 @@
+/* directories known to exist, so uploads skip the mkdir of every path prefix.
+
+   Each worker keeps a bounded table of hashes of path prefixes it created or
+   found, a cached prefix costs no system call. Requests that can remove or
+   rename a directory bump a generation shared by all workers, a worker that
+   sees a new one empties its table. Changes made outside the server are
+   caught when a file can not be created below a cached prefix: the table is
+   emptied and the directories are made again. Paths are relative to the
+   served directory, the working directory of the process. Needs dirscan.h
+   for AT_FDCWD */
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdint.h>
+
+#define DC_SLOTS 8192 // power of two, 64 KiB per worker
+#define DC_PROBE 8
+// mkdirat result of an existing directory, libc sets errno, raw system calls return it
+#define DC_Made( r ) ( !( r ) || (( r ) == -1 ? errno == EEXIST : ( r ) == -EEXIST ))
+
+static unsigned dc_local_gen;
+static volatile unsigned *dc_gen = &dc_local_gen; // NULL when the cache is off
+static unsigned dc_seen;
+static uint64_t dc_slot[DC_SLOTS]; // 0 is free, hashes have the low bit set
+
+// call before forking, so every worker sees the same generation
+static inline void DC_Open( void )
+{
+	void *p = (void *)mmap( NULL, sizeof( unsigned ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+
+	// libc returns MAP_FAILED, raw system calls a negative errno
+	dc_gen = (uintptr_t)p > -4096UL ? NULL : p;
+}
+
+// a directory may be gone or renamed, every worker starts over
+static inline void DC_Forget( void )
+{
+	if( dc_gen )
+		__atomic_add_fetch( dc_gen, 1, __ATOMIC_RELAXED );
+}
+
+static inline void DC_Sync( void )
+{
+	unsigned gen = __atomic_load_n( dc_gen, __ATOMIC_RELAXED );
+
+	if( gen != dc_seen )
+	{
+		memset( dc_slot, 0, sizeof( dc_slot ));
+		dc_seen = gen;
+	}
+}
+
+static inline int DC_Known( uint64_t h )
+{
+	unsigned i, home = h >> 32;
+
+	for( i = 0; i < DC_PROBE; i++ )
+	{
+		uint64_t s = dc_slot[( home + i ) & ( DC_SLOTS - 1 )];
+
+		if( s == h )
+			return 1;
+		if( !s )
+			return 0;
+	}
+	return 0;
+}
+
+// full probe windows give up their first slot
+static inline void DC_Add( uint64_t h )
+{
+	unsigned i, home = h >> 32;
+
+	for( i = 0; i < DC_PROBE; i++ )
+	{
+		uint64_t *s = &dc_slot[( home + i ) & ( DC_SLOTS - 1 )];
+
+		if( !*s || *s == h )
+		{
+			*s = h;
+			return;
+		}
+	}
+	dc_slot[home & ( DC_SLOTS - 1 )] = h;
+}
+
+/* make the directories leading to the last component of path. Returns how
+   many were skipped because they were cached */
+static inline int DC_MakeParents( const char *path )
+{
+	char dir[PATH_MAX];
+	uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a over the prefix
+	size_t i;
+	int r, skipped = 0;
+
+	if( dc_gen )
+		DC_Sync();
+	for( i = 0; path[i] && i < sizeof( dir ) - 1; i++ )
+	{
+		dir[i] = path[i];
+		if( path[i] == '/' && i )
+		{
+			if( dc_gen && DC_Known( h | 1 ))
+				skipped++;
+			else
+			{
+				dir[i] = 0;
+				r = mkdirat( AT_FDCWD, dir, 0777 );
+				if( dc_gen && DC_Made( r ))
+					DC_Add( h | 1 );
+				dir[i] = '/';
+			}
+		}
+		h = ( h ^ (unsigned char)path[i] ) * 0x100000001b3ULL;
+	}
+	return skipped;
+}
+
+// open, creating the file and the directories leading to it
+static inline int DC_Create( const char *path, int flags, int mode )
+{
+	int skipped = DC_MakeParents( path );
+	int fd = open( path, flags, mode );
+
+	if( fd < 0 && skipped )
+	{
+		memset( dc_slot, 0, sizeof( dc_slot ));
+		DC_MakeParents( path );
+		fd = open( path, flags, mode );
+	}
+	return fd;
+}
+
+#endif
@@ -0,0 +1,116 @@
+/* directory iteration shared by listings, DAV and zip.
+
+   Entries come from getdents64 in large batches, "." and ".." are dropped.
+   The entry type is taken from d_type when the file system fills it, and
+   metadata is read with fstatat relative to the open directory, so no full
+   path is built or walked per entry. Works with libc and with nolibc */
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#define DIRSCAN_BUF 32768
+
+#ifndef AT_FDCWD
+#define AT_FDCWD -100
+#endif
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#define DT_LNK 10
+#endif
+
+#ifdef getdents64 // nolibc maps it to the raw syscall
+#define D_GetDents( fd, buf, len ) getdents64( fd, buf, len )
+#define D_StatAt( fd, name, sb ) newfstatat( fd, name, sb, 0 )
+#else
+#include <sys/syscall.h>
+#define D_GetDents( fd, buf, len ) syscall( SYS_getdents64, fd, buf, len )
+#define D_StatAt( fd, name, sb ) fstatat( fd, name, sb, 0 )
+#endif
+
+#ifdef DIRECTORY_FLAG // O_DIRECTORY differs on arm, nolibc knows the right one
+#define D_OPEN_FLAGS ( O_RDONLY | DIRECTORY_FLAG )
+#else
+#define D_OPEN_FLAGS ( O_RDONLY | O_DIRECTORY | O_CLOEXEC )
+#endif
+
+typedef struct dirscan_ent_s
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} dirscan_ent_t;
+
+typedef struct dirscan_s
+{
+	int fd;
+	int pos, count;
+	char buf[DIRSCAN_BUF] __attribute__((aligned(8)));
+} dirscan_t;
+
+// name relative to dirfd, returns 0 if it is not an accessible directory
+static inline int D_OpenAt( dirscan_t *d, int dirfd, const char *name )
+{
+	d->fd = openat( dirfd, name, D_OPEN_FLAGS );
+	d->pos = d->count = 0;
+	return d->fd >= 0;
+}
+
+static inline dirscan_ent_t *D_Next( dirscan_t *d )
+{
+	for(;;)
+	{
+		dirscan_ent_t *e;
+
+		if( d->pos >= d->count )
+		{
+			d->count = D_GetDents( d->fd, d->buf, sizeof( d->buf ));
+			d->pos = 0;
+			if( d->count <= 0 )
+				return NULL;
+		}
+		e = (dirscan_ent_t *)&d->buf[d->pos];
+		d->pos += e->d_reclen;
+		if( e->d_name[0] != '.' || ( e->d_name[1] && ( e->d_name[1] != '.' || e->d_name[2] )))
+			return e;
+	}
+}
+
+static inline int D_Stat( dirscan_t *d, const char *name, struct stat *sb )
+{
+	return D_StatAt( d->fd, name, sb );
+}
+
+/* DT_DIR, DT_REG or another DT_ value. Symbolic links are followed and file
+   systems without d_type cost a stat, sb is filled only in that case and
+   *statted tells so */
+static inline int D_Type( dirscan_t *d, dirscan_ent_t *e, struct stat *sb, int *statted )
+{
+	*statted = 0;
+	if( e->d_type != DT_UNKNOWN && e->d_type != DT_LNK )
+		return e->d_type;
+	if( D_Stat( d, e->d_name, sb ))
+		return DT_UNKNOWN;
+	*statted = 1;
+	if( S_ISDIR( sb->st_mode ))
+		return DT_DIR;
+	if(( sb->st_mode & S_IFMT ) == S_IFREG )
+		return DT_REG;
+	return DT_UNKNOWN;
+}
+
+static inline void D_Rewind( dirscan_t *d )
+{
+	lseek( d->fd, 0, SEEK_SET );
+	d->pos = d->count = 0;
+}
+
+static inline void D_Close( dirscan_t *d )
+{
+	close( d->fd );
+	d->fd = -1;
+}
+
+#endif
@@ -0,0 +1,209 @@
+/* persistent checksum cache shared by all workers.
+
+   A fixed size open addressing table in a file under the user's cache
+   directory, one per served tree, opened before the workers fork, so they
+   see what the others computed and it survives restarts. It is never kept
+   inside the served tree, where clients could read or replace it and so
+   poison the CRCs zip trusts. Files are keyed by device, inode, size and
+   modification time, a changed file simply no longer finds its old slot.
+   Slots are read and written with pread and pwrite, a mapping would fault if
+   an upload truncated the file. There are no locks: each slot carries a check
+   over its fields, a slot torn by two writers fails it and reads as empty.
+
+   The sum is the CRC-32 zip needs, computed the first time a zip asks for
+   it, so uploads reply without reading their file back. Needs zlib.h and
+   crc32fold.h */
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <stdint.h>
+
+#define HC_NAME "webserver-c" // directory under $XDG_CACHE_HOME or ~/.cache
+#define HC_SLOTS ( 1 << 18 ) // power of two, 12 MiB of file, sparse until used
+#define HC_PROBE 8           // consecutive slots, the file has HC_PROBE spare ones at the end
+#define HC_MAGIC 0x32736d7573637768ULL // the last byte counts layout changes
+#define HC_BUF 262144
+
+typedef struct hcslot_s
+{
+	uint64_t dev, ino, size, mtime; // mtime in nanoseconds
+	uint32_t crc, spare;
+	uint64_t check;
+} hcslot_t;
+
+static int hc_fd = -1; // -1 without a cache. Slot 0 of the file is a header
+
+#ifdef ENABLE_LIBC
+#define HC_MTIME( sb ) ((uint64_t)( sb )->st_mtim.tv_sec * 1000000000 + ( sb )->st_mtim.tv_nsec )
+#else
+#define HC_MTIME( sb ) ((uint64_t)( sb )->st_mtime * 1000000000 )
+#endif
+
+static uint64_t HC_Check( const hcslot_t *s )
+{
+	uint64_t h = HC_MAGIC;
+	uint64_t v[5] = { s->dev, s->ino, s->size, s->mtime, s->crc };
+	int i;
+
+	for( i = 0; i < 5; i++ )
+	{
+		h = ( h ^ v[i] ) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+// file offset of the first probe slot of a file
+static off_t HC_Home( const struct stat *sb )
+{
+	uint64_t h = ( (uint64_t)sb->st_ino ^ (uint64_t)sb->st_dev << 40 ) * 0x9e3779b97f4a7c15ULL;
+
+	return (off_t)sizeof( hcslot_t ) * ( 1 + ( h >> 32 ) % HC_SLOTS );
+}
+
+// probe slots of a file, missing ones read as empty
+static void HC_ReadProbe( const struct stat *sb, hcslot_t *probe )
+{
+	ssize_t got = pread( hc_fd, probe, sizeof( hcslot_t ) * HC_PROBE, HC_Home( sb ));
+
+	if( got < (ssize_t)( sizeof( hcslot_t ) * HC_PROBE ))
+		memset( (char *)probe + ( got > 0 ? got : 0 ), 0, sizeof( hcslot_t ) * HC_PROBE - ( got > 0 ? got : 0 ));
+}
+
+/* cache file of the served tree, the working directory. 0 if there is no
+   cache directory or it lies inside the tree */
+static int HC_Path( char *path, size_t size )
+{
+	const char *base = getenv( "XDG_CACHE_HOME" ), *home = getenv( "HOME" );
+	char dir[PATH_MAX], real[PATH_MAX], root[PATH_MAX];
+	struct stat rs;
+	size_t n;
+
+	if( base && *base )
+		snprintf( dir, sizeof( dir ), "%s", base );
+	else if( home && *home )
+		snprintf( dir, sizeof( dir ), "%s/.cache", home );
+	else
+		return 0;
+	mkdir( dir, 0700 );
+	if( !realpath( dir, real ) || !realpath( ".", root ) || stat( ".", &rs ))
+		return 0;
+	n = strlen( root );
+	if( n == 1 || ( !strncmp( real, root, n ) && ( !real[n] || real[n] == '/' )))
+		return 0;
+	// a cut off name would point somewhere else
+	if( snprintf( dir, sizeof( dir ), "%s/" HC_NAME, real ) >= (int)sizeof( dir ))
+		return 0;
+	mkdir( dir, 0700 );
+	return snprintf( path, size, "%s/%llx-%llx", dir, (unsigned long long)rs.st_dev, (unsigned long long)rs.st_ino ) < (int)size;
+}
+
+// call before forking, every worker shares the descriptor. Without it nothing is cached
+static void HC_Open( void )
+{
+	off_t len = sizeof( hcslot_t ) * ( 1 + HC_SLOTS + HC_PROBE );
+	char path[PATH_MAX];
+	hcslot_t head;
+	struct stat sb;
+	int fd;
+
+	if( !HC_Path( path, sizeof( path )))
+		return;
+	fd = open( path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600 );
+	if( fd < 0 )
+		return;
+	if( fstat( fd, &sb ) || sb.st_size != len || pread( fd, &head, sizeof( head ), 0 ) != sizeof( head ) || head.dev != HC_MAGIC || head.ino != HC_SLOTS )
+	{
+		// new, foreign or other geometry: start empty
+		memset( &head, 0, sizeof( head ));
+		head.dev = HC_MAGIC;
+		head.ino = HC_SLOTS;
+		if( ftruncate( fd, 0 ) || ftruncate( fd, len ) || pwrite( fd, &head, sizeof( head ), 0 ) != sizeof( head ))
+		{
+			close( fd );
+			return;
+		}
+	}
+	hc_fd = fd;
+}
+
+static int HC_Lookup( const struct stat *sb, uint32_t *crc )
+{
+	hcslot_t probe[HC_PROBE];
+	int i;
+
+	if( hc_fd < 0 )
+		return 0;
+	HC_ReadProbe( sb, probe );
+	for( i = 0; i < HC_PROBE; i++ )
+	{
+		hcslot_t *s = &probe[i];
+
+		if( s->ino == (uint64_t)sb->st_ino && s->dev == (uint64_t)sb->st_dev &&
+			s->size == (uint64_t)sb->st_size && s->mtime == HC_MTIME( sb ) && s->check == HC_Check( s ))
+		{
+			*crc = s->crc;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// replaces an older entry of the same file, else takes a free slot, else evicts
+static void HC_Store( const struct stat *sb, uint32_t crc )
+{
+	hcslot_t probe[HC_PROBE], s;
+	int i, slot = -1;
+
+	if( hc_fd < 0 )
+		return;
+	HC_ReadProbe( sb, probe );
+	for( i = 0; i < HC_PROBE; i++ )
+	{
+		if( probe[i].ino == (uint64_t)sb->st_ino && probe[i].dev == (uint64_t)sb->st_dev )
+		{
+			slot = i;
+			break;
+		}
+		if( slot < 0 && probe[i].check != HC_Check( &probe[i] ))
+			slot = i;
+	}
+	if( slot < 0 )
+		slot = 0;
+	s.dev = sb->st_dev;
+	s.ino = sb->st_ino;
+	s.size = sb->st_size;
+	s.mtime = HC_MTIME( sb );
+	s.crc = crc;
+	s.spare = 0;
+	s.check = HC_Check( &s );
+	pwrite( hc_fd, &s, sizeof( s ), HC_Home( sb ) + (off_t)sizeof( s ) * slot );
+}
+
+/* sums of the open file described by sb, read and remembered on a miss. 0 if
+   there is no cache or the file changed while it was read */
+static int HC_Sum( int fd, const struct stat *sb, uint32_t *crc )
+{
+	static unsigned char buf[HC_BUF];
+	struct stat after;
+	off_t off = 0;
+	ssize_t got;
+
+	if( hc_fd < 0 )
+		return 0;
+	if( HC_Lookup( sb, crc ))
+		return 1;
+	*crc = crc32( 0, Z_NULL, 0 );
+	while(( got = pread( fd, buf, sizeof( buf ), off )) > 0 )
+	{
+		*crc = S_Crc32( *crc, buf, got );
+		off += got;
+	}
+	if( got < 0 || off != sb->st_size || fstat( fd, &after ) ||
+		after.st_size != sb->st_size || HC_MTIME( &after ) != HC_MTIME( sb ))
+		return 0;
+	HC_Store( sb, *crc );
+	return 1;
+}
+
+#endif
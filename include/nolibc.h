@@ -336,3 +336,74 @@ static struct tm tm_stub;
 #define assert(x) if(!(x))puts(#x),_exit(127);
 
 
+
+// event loop bits missing from bqc.h
+#ifndef EPOLLIN
+typedef union epoll_data {
+	void *ptr;
+	int fd;
+	uint32_t u32;
+	uint64_t u64;
+} epoll_data_t;
+struct epoll_event {
+	uint32_t events;
+	epoll_data_t data;
+}
+#ifdef __x86_64__
+__attribute__((packed))
+#endif
+;
+#define EPOLLIN 0x001
+#define EPOLLOUT 0x004
+#define EPOLLERR 0x008
+#define EPOLLHUP 0x010
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+#endif
+#ifndef epoll_wait
+#define epoll_wait(a,b,c,d) epoll_pwait(a,b,c,d,NULL,8)
+#endif
+#ifndef SOCK_NONBLOCK
+#define SOCK_NONBLOCK O_NONBLOCK
+#endif
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1U << 28)
+#endif
+#define waitpid(p,s,o) wait4(p,s,o,NULL)
+#ifndef PR_SET_PDEATHSIG
+#define PR_SET_PDEATHSIG 1
+#endif
+#ifndef SIGTERM
+#define SIGTERM 15
+#endif
+#ifndef TCP_NODELAY
+#define TCP_NODELAY 1
+#endif
+#ifndef TCP_CORK
+#define TCP_CORK 3
+#endif
+#ifndef memmove
+static inline void *memmove( void *dp, const void *sp, size_t n )
+{
+	unsigned char *d = dp;
+	const unsigned char *s = sp;
+	if( d < s )
+		while( n-- ) *d++ = *s++;
+	else
+		while( n-- ) d[n] = s[n];
+	return dp;
+}
+#endif
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#define SPLICE_F_MORE 4
+#endif
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
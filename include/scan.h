@@ -0,0 +1,132 @@
+/* buffer scanning for the request reader.
+
+   Both helpers look at [p, end) only, the buffer does not need a NUL
+   terminator. SSE2 (AVX2 when enabled) and NEON check 16 or 32 bytes per
+   step, other targets fall back to a bytewise loop. Vector code is written
+   with compiler builtins, the intrinsic headers clash with nolibc types */
+#ifndef SCAN_H
+#define SCAN_H
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCAN_NEON
+#elif defined(__SSE2__)
+#define SCAN_SSE2
+typedef char scan_v16 __attribute__((vector_size(16), aligned(1), __may_alias__));
+#ifdef __AVX2__
+typedef char scan_v32 __attribute__((vector_size(32), aligned(1), __may_alias__));
+#endif
+#endif
+
+#ifdef SCAN_NEON
+// one nibble per byte of the compare result
+static inline unsigned long long S_ScanMask( uint8x16_t eq )
+{
+	return vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( eq ), 4 )), 0 );
+}
+#endif
+
+// first c in [p, end) or NULL
+static inline const char *S_FindByte( const char *p, const char *end, char c )
+{
+#if defined(SCAN_SSE2)
+#ifdef __AVX2__
+	scan_v32 v32 = { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c,
+					 c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+	while( end - p >= 32 )
+	{
+		unsigned int mask = __builtin_ia32_pmovmskb256( (scan_v32)( *(const scan_v32 *)p == v32 ));
+		if( mask )
+			return p + __builtin_ctz( mask );
+		p += 32;
+	}
+#endif
+	scan_v16 v = { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+	while( end - p >= 16 )
+	{
+		unsigned int mask = __builtin_ia32_pmovmskb128( (scan_v16)( *(const scan_v16 *)p == v ));
+		if( mask )
+			return p + __builtin_ctz( mask );
+		p += 16;
+	}
+#elif defined(SCAN_NEON)
+	uint8x16_t v = vdupq_n_u8( c );
+	while( end - p >= 16 )
+	{
+		unsigned long long mask = S_ScanMask( vceqq_u8( vld1q_u8( (const uint8_t *)p ), v ));
+		if( mask )
+			return p + ( __builtin_ctzll( mask ) >> 2 );
+		p += 16;
+	}
+#endif
+	for( ; p < end; p++ )
+		if( *p == c )
+			return p;
+	return NULL;
+}
+
+/* first needle in [p, end) or NULL. Candidates must match the first and
+   the last needle byte, only those are compared in full, so long multipart
+   boundaries cost about as much as a single byte search */
+static inline const char *S_FindString( const char *p, const char *end, const char *needle, size_t len )
+{
+	const char *last;
+
+	if( !len )
+		return p;
+	if( end - p < (long)len )
+		return NULL;
+	last = end - len; // last possible start
+
+#if defined(SCAN_SSE2)
+	{
+		scan_v16 first = { needle[0], needle[0], needle[0], needle[0], needle[0], needle[0], needle[0], needle[0],
+						   needle[0], needle[0], needle[0], needle[0], needle[0], needle[0], needle[0], needle[0] };
+		char l = needle[len - 1];
+		scan_v16 lastc = { l, l, l, l, l, l, l, l, l, l, l, l, l, l, l, l };
+
+		while( last - p >= 15 )
+		{
+			scan_v16 a = *(const scan_v16 *)p == first;
+			scan_v16 b = *(const scan_v16 *)( p + len - 1 ) == lastc;
+			unsigned int mask = __builtin_ia32_pmovmskb128( (scan_v16)( a & b ));
+
+			while( mask )
+			{
+				int i = __builtin_ctz( mask );
+				if( !memcmp( p + i, needle, len ))
+					return p + i;
+				mask &= mask - 1;
+			}
+			p += 16;
+		}
+	}
+#elif defined(SCAN_NEON)
+	{
+		uint8x16_t first = vdupq_n_u8( needle[0] );
+		uint8x16_t lastc = vdupq_n_u8( needle[len - 1] );
+
+		while( last - p >= 15 )
+		{
+			uint8x16_t a = vceqq_u8( vld1q_u8( (const uint8_t *)p ), first );
+			uint8x16_t b = vceqq_u8( vld1q_u8( (const uint8_t *)( p + len - 1 )), lastc );
+			unsigned long long mask = S_ScanMask( vandq_u8( a, b )) & 0x1111111111111111ULL;
+
+			while( mask )
+			{
+				int i = __builtin_ctzll( mask ) >> 2;
+				if( !memcmp( p + i, needle, len ))
+					return p + i;
+				mask &= mask - 1;
+			}
+			p += 16;
+		}
+	}
+#endif
+	for( ; p <= last; p++ )
+		if( *p == *needle && !memcmp( p, needle, len ))
+			return p;
+	return NULL;
+}
+
+#endif
@@ -0,0 +1 @@
+static const char page_content[] = "<html>\n<head>\n<title>upload test</title>\n<script>\nvar globallog = \"\"\nvar pagelog;\nfunction synclog()\n{\n    if(!pagelog)\n		pagelog = document.getElementById(\"pagelog\");\n    pagelog.value = globallog;\n	pagelog.scrollTop = pagelog.scrollHeight;\n}\n\nfunction writelog(text,sync)\n{\n    if(globallog.length > 32768)\n        globallog = globallog.substring(16384);\n    globallog += \"\"+text+\"\\n\";\n	if(sync)synclog();\n}\n\nObject.keys = Object.keys || (function () {\n    var hasOwnProperty = Object.prototype.hasOwnProperty,\n        hasDontEnumBug = !{toString:null}.propertyIsEnumerable(\"toString\"),\n        DontEnums = [ \n            'toString', 'toLocaleString', 'valueOf', 'hasOwnProperty',\n            'isPrototypeOf', 'propertyIsEnumerable', 'constructor'\n        ],\n        DontEnumsLength = DontEnums.length;\n        \n    return function (o) {\n        if (typeof o != \"object\" && typeof o != \"function\" || o === null)\n            throw new TypeError(\"Object.keys called on a non-object\");\n    \n        var result = [];\n        for (var name in o) {\n            if (hasOwnProperty.call(o, name))\n                result.push(name);\n        }\n    \n        if (hasDontEnumBug) {\n            for (var i = 0; i < DontEnumsLength; i++) {\n                if (hasOwnProperty.call(o, DontEnums[i]))\n                    result.push(DontEnums[i]);\n            }   \n        }\n    \n        return result;\n    };\n})();\n\n\nfunction writeerror(e)\n{\n	var text = \"Exception: \"\n	try{\n		text += \"\" + e;\n	}catch(e){}\n	try{\n		text += \" \" + e.name;\n	}catch(e){}\n	try{\n		text += \" \" + e.message;\n	}catch(e){}\n	try{\n		if(e.description)\n			text += \" \" + e.description;\n	}catch(e){}\n	try{\n		if(e.method)\n			text += \" \" + e.method;\n	}catch(e){}\n	try{\n		text += \" \" + e.fileName + \":\" + (e.lineNumber || e.number) ;\n	}catch(e){}\n	try{\n		if(e.stack)\n			text += \" \" + e.stack;\n	}catch(e){}\n	// hack: rethrow error for onerror and browser-internal handler\n	try{\n		setTimeout(function(){throw(e);},100);\n		writelog(Object.keys(e), true);\n	}catch(e){}\n	writelog(text, true);\n}\n</script>\n</head>\n<body onerror=\"writelog(event, true);writelog(event.message, true);\">\n<style>\n\nhtml, body {\n  height: 100%; }\n\nhtml {\n  background-color: #222; }\n\nbody {\n  position: relative;\n  /*max-width: 1024px;\n  min-width: 768px;*/\n  min-width: 600px;\n  margin: 0 auto;\n  font: 12px sans-serif;\n}\n\nheader {\n  color: #fff;\n  background-color: #000;\n  height: 24px;\n  overflow: hidden; }\n\n.sidebar td {\n  color: #fff;\n  background-color: #000;\n }\n.sidebar a:link {\ncolor: #FFA;\n}\n.sidebar a:visited {\ncolor: #FFC;\n}\n\n\n.sidebar, .main {\n\n  -webkit-overflow-scrolling: touch;\n  position: absolute;\n  	top: 24px;\n  bottom: 0; }\n\n.sidebar {\n  overflow:scroll;\n  overflow-x:auto;\n  width: 50%;\n  background-color: #333;\n  left: 0; }\n\n.main {\n  overflow: hidden;\n  background-color: #f5f5f5;\n  position: absolute;\n  left: 50%;\n  width: 50%;\n  right: 0;\n  /*padding: 20px;*/\n  padding-bottom:25px; }\n\n</style>\n<header><div style=\"position:absolute;overflow:hidden;color:white\" id=\"pathdisplay\"></div><div style=\"position:absolute;right:0px;overflow:hidden\">\n<input type=\"checkbox\" id=\"enable_fileapi\"/><label for=\"enable_fileapi\" style=\"color:white;\">Enable FileList API</label>\n<input type=\"checkbox\" id=\"enable_xhr\"/><label for=\"enable_xhr\"  style=\"color:white;\">Enable XHR</label>\n<button id=\"mkdir\" onclick=\"mkdirClick()\">Create Directory</button>\n<button id=\"mkfile\"  onclick=\"createFile();\">Create File</button>\n\n</div>\n</header>\n<div class=\"sidebar\"><div id=\"filelist\"></div><iframe src=\"/indexredir\" width=\"100%\" height=\"100%\" style=\"border:0;padding:0;\" loading=\"lazy\" id=\"legacyframe\"></iframe></div>\n<div class=\"main\" id=\"uploadcontainer\">	\n<table border=\"0\" height=\"100%\">\n<tr><td><form><label for=\"filesdir\">Upload&nbsp;dir:</label><br />\n<input id=\"filesdir\" name=filesdir\n      type=\"file\"\n      directory=\"directory\"\n      multiple\n	  size=\"4\"\n      webkitdirectory=\"webkitdirectory\"  style=\"font:40% sans-serif;max-width:100px\" disabled />\n<input type=\"button\" value=\"Upload\" disabled id=\"upload\" onclick=\"startUpload()\" /></form></td><td  style=\"vertical-align: top;\">\n<form  id=\"legacyupload\" method=\"POST\" action=\"/legacyupload\" encoding=\"multipart/form-data\" enctype=\"multipart/form-data\"><label for=\"file\">Upload&nbsp;file:</label><br />\n<input id=\"file\" name=\"file\"\n      type=\"file\" \n      multiple size=\"4\" style=\"font:40% sans-serif;max-width:100px\" />\n<input type=\"submit\" value=\"Send\" id=\"uploadlegacy\"/></form></td>\n<td  style=\"vertical-align: top;\"><form  id=\"zipform\" method=\"POST\" action=\"/legacyzip\" encoding=\"multipart/form-data\" enctype=\"multipart/form-data\"><label for=\"zipfile\">Upload&nbsp;zip:</label><br />\n<input id=\"zipfile\" name=\"zipfile\"\n      type=\"file\"\n size=\"4\" style=\"font:40% sans-serif;max-width:100px\" />\n<input type=\"submit\" value=\"Extract\" id=\"uploadzip\"/></form></td>\n<td border=\"0\" width=\"100%\" cellspacing=\"0\"></td><td border=\"0\" width=\"0\" cellspacing=\"0\"></td></tr><tr>\n<td height=\"100%\" width=\"100%\" colspan=\"4\">\n<div id=\"dropcontainer\" style=\"border:1px solid black;width:100%;height:75%;\">Drop here</div><textarea id=\"pagelog\"  style=\"width:100%;height:25%;resize:none;\"></textarea>\n</div>\n</td><td border=\"0\" cellspacing=\"0\" style=\"width:0;border-color:#f5f5f5;border-width:0;padding:0;\"><div style=\"height:200px;width:0;overflow:hidden;padding:0;\" ><br/></div></td>\n</tr></table></div>\n<div id=\"editorcontainer\" class=\"main\" style=\"padding-bottom:40px;overflow:hidden;display:none\">\n<button onclick=\"saveEdit();\">Save</button><button onclick=\"cancelEdit();\">Cancel</button><br/>\n<textarea id=\"editor\" style=\"width:100%;height:100%;resize:none;\"></textarea>\n</div>	\n</div>\n<!--[if IE]>\n<script>\nwindow.onresize = document.body.onload =  function()\n{\n	uploadContainer.style.height = document.body.clientHeight - 26;\n	if(oldFileList)\n		oldFileList.style.height = document.body.clientHeight - 26;\n	fileListContainer.parentNode.style.height = document.body.clientHeight - 26;\n}\n</script>\n<![endif]-->\n\n<script>\nwindow.onerror = function(msg, url, lno) {\n	\n	writelog(\"Error handler:\" + \"\\n\" +\n		\"Error: \" + msg + \"\\n\" + \"URL: \" + url + \"\\n\" +\n		\"Line Number: \" + lno, true);\n	\n	return false; // let browser print error to\n}\n</script>\n\n\n<script>\n\n// ie\n\nfunction parseJSON(text)\n{\n	if(\"JSON\" in window)\n	{\n		return JSON.parse(text);\n	}\n	else return eval(\"(\"+text+\")\");\n}\n\nif(('navigator' in window) && window.navigator && window.navigator.userAgent.indexOf(\"ELinks\") >= 0)\n{\n	writelog = alert;\n	XMLHttpRequest.prototype.open_orig = XMLHttpRequest.prototype.open;\n	XMLHttpRequest.prototype.open = function(a,b,c)\n	{\n		this.open_orig(a,document.location.href + b.substring(1),c);\n	};\n}\n\nfunction getXMLHttpRequest()\n{\n	var xhr = null;\n\n	if(window.XMLHttpRequest)\n		xhr = new XMLHttpRequest();\n	else if(window.ActiveXObject) { // poor alternative, but at least filelist and editing works\n		try {\n			xhr = new ActiveXObject(\"Msxml2.XMLHTTP\");\n			xhr.open(\"GET\",\"/\", true); // it may throw DLLError\n			xhr = new ActiveXObject(\"Msxml2.XMLHTTP\");\n		} catch(e) {\n			writeerror(e);\n			try {\n				xhr = new ActiveXObject(\"Microsoft.XMLHTTP\");\n			}\n			catch(e) {\n				writeerror(e);\n			}\n		}\n	}\n	else\n	{\n		writelog(\"Your browser doesn't support XMLHTTPRequest...\", true);\n	}\n	return xhr;\n}\n\nvar XMLHttpRequest_DONE = 4\n\n\nvar dropContainer = document.getElementById(\"dropcontainer\")\ndropContainer.ondragover = dropContainer.ondragenter = function(event) {\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	if(event && event.preventDefault)\n		event.preventDefault();\n	if(event.dataTransfer)\n		event.dataTransfer.dropEffect = 'copy';\n	return false;\n};\ndropContainer.ondrop = function(event) {\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	if(event && event.preventDefault)\n		event.preventDefault();\n 	if('Promise' in window && event.dataTransfer && event.dataTransfer.items && event.dataTransfer.items[0].webkitGetAsEntry)\n	{\n		writelog(\"Drop event, using async mode\", true);\n		processDTItemsAsync(event.dataTransfer.items).then(function(files){\n			processFiles(files);\n		});\n	}\n	else\n	{\n		writelog(\"Drop event, using sync mode (slow)\", true);\n		processDTItems(event.dataTransfer);\n	}\n	return false;\n};\n\nfunction resolveFile(resolve, item, path, fileList)\n{\n	item.file(function(file) {\n		file.filepath = path + file.name; //save full path\n		fileList.push(file);\n		resolve(file);\n	});\n}\n\nfunction resolveDir(resolve, item, path, fileList)\n{\n	var dirReader = item.createReader();\n	dirReader.readEntries(function(entries){\n		var entriesPromises = [];\n		for (var i = 0; i < entries.length;i++)\n			entriesPromises.push(traverseItems(entries[i], (path ? path :\"\") + item.name + \"/\", fileList));\n		resolve(Promise.all(entriesPromises));\n	});\n}\n\nfunction resolveItem(resolve, item, path, fileList)\n{\n	if (item.isFile)\n		resolveFile(resolve, item, path, fileList);\n	else if (item.isDirectory)\n		resolveDir(resolve, item, path, fileList);\n}\n\nfunction traverseItems(item, path, fileList)\n{\n	return new Promise(function(resolve){\n		resolveItem(resolve, item, path, fileList);\n	});\n}\n\nfunction processDTItemsAsync(dataTransferItems) // do we ever need this???\n{\n	var files = [];\n	return new Promise(function(resolve, reject){\n	var entriesPromises = [];\n		for (var i = 0; i < dataTransferItems.length;i++)\n			entriesPromises.push(traverseItems(dataTransferItems[i].webkitGetAsEntry(), \"\", files));\n		Promise.all(entriesPromises).then(function(entries){\n			resolve(files);\n		});\n	});\n}\nfunction traverseFileTree(item, path) {\n  path = path || \"\";\n  if (item.isFile) {\n    // Get file\n    item.file(function(file) {\n      file.filepath = path + file.name;\n		selectedfiles.push(file);\n		processFiles([]);\n    });\n  } else if (item.isDirectory) {\n    // Get folder contents\n    var dirReader = item.createReader();\n    dirReader.readEntries(function(entries) {\n      for (var i=0; i<entries.length; i++) {\n        traverseFileTree(entries[i], path + item.name + \"/\");\n      }\n    });\n  }\n}\nfunction processDTItems(dataTransfer)\n{\n	var items = dataTransfer.items;\n\n	if(!items || !items[0].webkitGetAsEntry)\n	{\n		// this cannot handle folders at all\n		writelog(\"no DataTransder items, folders will fail...\", true);\n		processFiles(dataTransfer.files);\n		return;\n	}\n\n	for (var i=0; i < items.length; i++) {\n		// this handles folders and files in async way, we'll update file list on every file (slow)\n		var item = dataTransfer.items[i].webkitGetAsEntry();\n		traverseFileTree(item);\n	}\n}\n\nvar pendingfiles = [];\nvar selectedfiles = [];\nvar uploadingfiles = [];\n\nvar list_path = \"\";\n\nfunction uploadFile(file)\n{\n	uploadingfiles.push(file);\n	var req = getXMLHttpRequest();\n	var path = (file.filepath|| file.webkitRelativePath || file.name);\n	writelog(\"uploading:\"+path);\n	req.open(\"PUT\", \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+path, true);\n	req.onreadystatechange = function(){\n		//writelog(\"readyState(\"+path+\"):\"+req.readyState);\n		if (req.readyState === XMLHttpRequest_DONE) {\n			var status = req.status;\n			//writelog(\"status(\"+path+\"):\"+status);\n\n\n			if ((status === 0 || (status >= 200 && status < 400)) && req.responseText == 'OK' ) {\n\n			} else {\n				pendingfiles.push(file);\n				writelog(\"error:\"+path, true);\n			}\n 			var index = uploadingfiles.indexOf(file);\n			if(index >= 0)\n			uploadingfiles.splice(index, 1);\n			scheduleUpload();\n		}\n	}\n	req.send(file)\n}\nvar last_update = new Date();\nfunction updateStatus()\n{\n	var now = new Date();\n	if(now - last_update > 400)\n	{\n		last_update = now;\n		var count = pendingfiles.length;\n		var status = \"Files left: \" + count + \"\\nUploading now:\\n\" ;\n		for(var i = 0; i < uploadingfiles.length; i++)\n		{\n			var file = uploadingfiles[i];\n			status += (file.filepath|| file.webkitRelativePath|| file.name) + \"\\n\";\n		}\n		dropContainer.innerText = status;\n		synclog();\n	}\n}\n\n\n\nfunction scheduleUpload()\n{\n	while(uploadingfiles.length < 16 && pendingfiles.length > 0)\n	{\n		uploadFile(pendingfiles.pop())\n	}\n	updateStatus();\n	if(uploadingfiles.length == 0 && pendingfiles.length == 0)\n	{\n		alert(\"upload done!\");\n		resetSelection();\n		updateList();\n	}\n}\n\nfunction processFiles(files)\n{\n	if(pendingfiles.length)\n		return;	\n	if(selectedfiles.length)\n		selectedfiles = Array.prototype.concat(selectedfiles,Array.prototype.slice.call(files))\n	else if(files)\n		selectedfiles = Array.prototype.slice.call(files);\n\n	var len = selectedfiles.length;\n	uploadButton.disabled = false;\n	dropContainer.innerText = \"\" + len + \" files selected, click \\\"Upload\\\" to start now!\";\n}\n\nfunction startUpload()\n{\n	pendingfiles = selectedfiles;\n	uploadButton.disabled = true;\n	if(oldFileList)\n		fileListContainer.removeChild(oldFileList);\n	oldFileList = null;\n	scheduleUpload();\n}\n\nfunction resetSelection()\n{\n	dropContainer.innerText = \"Drop here\";\n	selectedFiles = [];\n}\n\nfunction delfile(path)\n{\n	if(!confirm(\"Delete \"+path))\n		return;\n	var req = getXMLHttpRequest();\n	req.open(\"DELETE\", path, true);\n	req.onreadystatechange = function(){\n		//writelog(\"readyState(\"+path+\"):\"+req.readyState);\n		if (req.readyState === XMLHttpRequest.DONE) {\n			updateList();\n		}\n	}\n	req.send();\n}\nfunction folderWalk(name)\n{\n	if(list_path.length)\n		list_path += '/';\n	list_path += name;\n	updateList();\n}\nfunction folderUp()\n{\n	var i = list_path.lastIndexOf('/');\n	writelog(i, true);\n	list_path = i >= 0?list_path.substring(0,i):\"\";\n	updateList();\n}\n\nvar oldFileList = null;\nvar fileListContainer = document.getElementById(\"filelist\");\nvar pathDisplay = document.getElementById(\"pathdisplay\");\nvar uploadButton = document.getElementById(\"upload\");\nvar editorContainer = document.getElementById(\"editorcontainer\");\nvar uploadContainer = document.getElementById(\"uploadcontainer\");\n\n\nfunction folderClick(event)\n{\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	folderWalk(event.target.data);\n}\n\nfunction delClick(event)\n{\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	delfile(event.target.data || event.srcElement.data);\n}\nvar editpath = \"\";\nfunction saveEdit()\n{\n	var text = document.getElementById(\"editor\").value;\n	writelog(\"Saving file: \" + editpath, true);\n	var req = getXMLHttpRequest();\n	req.open(\"PUT\", editpath, true);\n	req.onreadystatechange = function(){\n		writelog(\"readyState(\"+editpath+\"):\"+req.readyState);\n		if (req.readyState === XMLHttpRequest_DONE) {\n			var status = req.status;\n			//writelog(\"status(\"+path+\"):\"+status);\n\n\n			if ((status === 0 || (status >= 200 && status < 400))) {\n				editorContainer.style.display = 'none';\n				uploadContainer.style.display = 'block';\n				updateList();\n			}\n		}\n		synclog();\n	};\n	if('Blob' in window)\n		req.send(new Blob([text],{type:\"text/plain\"}));\n	else\n		req.send(text);\n}\n\nfunction editFile(path)\n{\n	editpath = path;\n	writelog(\"Editing file: \" + editpath, true);\n	var req = getXMLHttpRequest();\n	req.open(\"GET\", editpath, true);\n	editorContainer.style.display = 'block';\n	uploadContainer.style.display = 'none';\n\n	req.onreadystatechange = function(){\n		writelog(\"edreadyState(\"+editpath+\"):\"+req.readyState);\n		if (req.readyState == XMLHttpRequest_DONE) {\n				var status = req.status;\n			writelog(\"edstatus():\"+status);\n\n\n			if ((status === 0 || (status >= 200 && status < 400)) && req.responseText.length >= 0 && req.responseText.length < 65535) {\n				document.getElementById(\"editor\").value = req.responseText;\n			}\n		}\n		synclog();\n	};\n	req.send(\"\");\n}\n\nfunction editClick(event)\n{\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n\n	editFile(event.target.data);\n}\n\nfunction createFile()\n{\n	editpath =\"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+prompt(\"New file name\", \"\");\n	editorContainer.style.display = 'block';\n	uploadContainer.style.display = 'none';\n	document.getElementById(\"editor\").value = \"\";\n}\n\nfunction cancelEdit()\n{\n	editorContainer.style.display = 'none';\n	uploadContainer.style.display = 'block';\n}\n\nfunction delDirClick(event)\n{\n}\n\nfunction zipClick(event)\n{\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	var a = document.createElement(\"a\");\n	a.href = event.target.data;\n	a.appendChild(document.createTextNode(\"Download zip \" + event.target.data));\n	a.target = \"_blank\";\n	dropContainer.appendChild(document.createElement(\"br\"));\n	dropContainer.appendChild(a);\n}\n\nfunction mkdirClick()\n{\n	var req = getXMLHttpRequest();\n	var path= prompt(\"Folder name\", \"\");\n	if(!path || !path.length)\n		return;\n	req.open(\"MKCOL\", \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+path+ \"/\", true);\n	req.onreadystatechange = function(){\n		if (req.readyState === XMLHttpRequest_DONE) {\n				var status = req.status;\n			writelog(status, true);\n			if ((status === 0 || (status >= 200 && status < 400))) {\n				updateList();\n			}\n		}\n	}\n	req.send(\"\");\n}\n\nfunction moveClick(event)\n{\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	var newName = prompt(\"New filename\", event.target.data);\n	if(!newName || !newName.length)\n		return;\n	if(newName.indexOf(\"/\") < 0)\n		newName = \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+newName;\n	var req = getXMLHttpRequest();\n	req.open(\"MOVE\", event.target.data, true);\n	req.setRequestHeader(\"Destination\", newName);\n	req.onreadystatechange = function(){\n		if (req.readyState === XMLHttpRequest_DONE) {\n				var status = req.status;\n			writelog(status, true);\n			if ((status === 0 || (status >= 200 && status < 400))) {\n				updateList();\n			}\n		}\n	}\n	req.send(\"\");\n}\nvar legacyframe = document.getElementById(\"legacyframe\");\nvar enable_xhr = document.getElementById(\"enable_xhr\");\nvar enable_fileapi = document.getElementById(\"enable_fileapi\");\n\n// POST forms name their target directory in the url: /legacyupload/<dir>\nfunction setPostTarget()\n{\n	var path = list_path;\n	try{\n		if(!enable_xhr.checked)\n		{\n			// without XHR the user browses in the index frame\n			var loc = legacyframe.contentWindow.location.pathname;\n			if(loc.indexOf(\"/index/\") === 0)\n				path = decodeURIComponent(loc.substring(7)).replace(/\\/+$/, \"\");\n		}\n	}catch(e){writeerror(e);}\n	document.getElementById(\"legacyupload\").action = \"/legacyupload/\"+path;\n	document.getElementById(\"zipform\").action = \"/legacyzip/\"+path;\n}\n\nfunction updateList()\n{\n	if(oldFileList)\n		fileListContainer.removeChild(oldFileList);\n	oldFileList = null;\n	var req = getXMLHttpRequest();\n	if(!req)\n	{\n		enable_xhr.checked = false;\n		enable_xhr.disabled = true;\n	}\n	if(!enable_xhr.checked)\n	{\n		legacyframe.style.display = \"block\";\n		legacyframe.src = \"/index/\"+list_path;\n		return;\n	}\n	if(list_path.length)\n		pathDisplay.innerText = list_path;\n	else\n		pathDisplay.innerText = \"(root)\";\n	writelog(\"Listing files: \" + \"/list/\"+list_path, true);\n\n	try{\n		req.open(\"GET\", \"/list/\"+list_path, true);\n	}\n	catch(e)\n	{\n		//enable_xhr.disabled = true;\n		enable_xhr.checked = false;\n		writeerror(e);\n		writelog(\"XHR disabled\",true);\n		return;\n	}\n\n	req.onreadystatechange = function(){\n		if (req.readyState === XMLHttpRequest_DONE) {\n				var status = req.status;\n			writelog(\"status(\"+list_path+\"):\"+status, true);\n			try{\n\n			if ((status === -1 || status === 0 || (status >= 200 && status < 400))) {\n				var tbl = document.createElement(\"table\");\n				tbl.setAttribute(\"border\", \"2\");\n				var tbd = document.createElement(\"tbody\");\n				var row = document.createElement(\"tr\");\n				var cell = document.createElement(\"td\");\n				cell.width = \"100%\";\n				if(list_path.length)\n				{\n					cell.appendChild(document.createTextNode(\"..\"))\n					cell.onclick = folderUp;\n				}\n				else\n					cell.appendChild(document.createTextNode(\"(root)\"));\n				row.appendChild(cell);\n				cell = document.createElement(\"td\");\n				cell.appendChild(document.createTextNode(\"<up>\"));\n				row.appendChild(cell);\n				tbd.appendChild(row);\n\n				//var str = \"<a  onclick=\\\"folderUp();\\\">..</a><br>\"\n				var arr = parseJSON(req.responseText);\n				for(var i = 0; i < arr.length; i++)\n				{\n					var item = arr[i];\n					if(item.type == 1)\n					{\n						row = document.createElement(\"tr\");\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"a\");\n						link.appendChild(document.createTextNode(item.name));\n						link.href=\"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name;\n						link.target=\"_blank\";\n						cell.appendChild(link)\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						cell.appendChild(document.createTextNode(item.size));\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"button\");\n						link.data = \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name;\n						link.onclick = moveClick;\n						link.appendChild(document.createTextNode(\"mv\"));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"button\");\n						link.data = \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name;\n						link.onclick = delClick;\n						link.appendChild(document.createTextNode(\"del\"));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"button\");\n						link.data = \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name;\n						if(item.size < 65536)\n							link.onclick = editClick;\n						else\n							link.disabled = true;\n						link.appendChild(document.createTextNode(\"ed\"));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						tbd.appendChild(row);\n					}\n					//str += \"<a href=\\\"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name+\"\\\">\"+item.name+\" (\"+item.size+\")</a><a onclick=\\\"delfile('/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name+\"')\\\">del</a><br>\";\n					else if(item.type == 0)\n					{\n						row = document.createElement(\"tr\");\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"a\");\n						link.onclick = folderClick;\n						link.data = item.name;\n						link.appendChild(document.createTextNode(item.name));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						cell.appendChild(document.createTextNode(\"<dir>\"));\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"button\");\n						link.data = \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name;\n						link.onclick = moveClick;\n						link.appendChild(document.createTextNode(\"mv\"));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"button\");\n						link.data = \"/files/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name;\n						link.onclick = delDirClick;\n						link.appendChild(document.createTextNode(\"del\"));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						cell = document.createElement(\"td\");\n						link = document.createElement(\"button\");\n						link.data = \"/zip/\"+list_path+(list_path.length >0?\"/\":\"\")+item.name+\".zip\";\n						link.onclick = zipClick;\n						link.appendChild(document.createTextNode(\"zip\"));\n						cell.appendChild(link);\n						row.appendChild(cell);\n						tbd.appendChild(row);\n					}\n						//str += \"<a onclick=\\\"folderWalk('\"+item.name+\"');\\\">\"+item.name+\"</a><br>\";\n				}\n				tbl.appendChild(tbd);\n				//document.getElementById(\"filelist\").innerHTML=str;\n				legacyframe.style.display = \"none\";\n\n				fileListContainer.appendChild(tbl);\n				//fileListContainer.parentNode.removeChild(document.getElementById(\"legacyframe\"))\n				oldFileList = tbl;\n				\n\n			} else {\n			}\n			}catch(e){\n				writeerror(e);legacyframe.style.display = \"block\";}\n		}\n	}\n	req.send(\"\");\n	\n}\n\n\nenable_xhr.checked = true;\nenable_xhr.onclick = updateList;\n\nvar filesdir = document.getElementById(\"filesdir\")\nfilesdir.onchange = function(event) {\n	if(!event) event = window.event;\n	if(!event.target)\n		event.target = event.srcElement;\n	processFiles(event.target.files);\n};\n\nfunction uploadZip()\n{\n	if(!enable_fileapi.checked)\n	{\n		try\n		{\n			setPostTarget();\n			document.getElementById(\"zipform\").submit();\n		}\n		catch(e){writeerror(e);document.getElementById(\"uploadzip\").onclick = null;}\n		return true;\n	}\n\n	var req = getXMLHttpRequest();\n	req.open(\"PUT\", \"/zip/\"+list_path+ (list_path.length >0?\"/\":\"\"), true);\n	document.getElementById(\"uploadzip\").disabled = true;\n	req.onreadystatechange = function(){\n		if (req.readyState === XMLHttpRequest_DONE) {\n			document.getElementById(\"uploadzip\").disabled = false;\n			var status = req.status;\n			writelog(\"status(zip:\"+list_path+\"):\"+status, true);\n\n			if ((status === -1 || status === 0 || (status >= 200 && status < 400))) {\n				alert(req.responseText);\n				writelog(req.responseText);\n				updateList();\n			}\n		}\n	}\n	req.send(document.getElementById(\"zipfile\").files[0]);\n	return false;\n}\n\nfunction updateFileAPI()\n{\n	var uploadzip = document.getElementById(\"uploadzip\");\n	if(enable_fileapi.checked)\n	{\n		filesdir.disabled = false;\n		document.getElementById(\"uploadlegacy\").style.display = \"none\";\n		uploadzip.disabled = document.getElementById(\"zipfile\").files && document.getElementById(\"zipfile\").files.length == 0;\n		uploadzip.onclick = uploadZip;\n		uploadButton.unclick = startUpload;\n	}\n	else\n	{\n\n		filesdir.disabled = true;\n		uploadButton.disabled = true;\n		document.getElementById(\"uploadlegacy\").style.display = \"block\";\n		uploadzip.disabled = false;\n	}\n}\n\ntry\n{\n	if(\"files\" in filesdir && filesdir.files !== undefined)\n	{\n		enable_fileapi.checked = true;\n		enable_fileapi.disabled = false;\n	}\n	else\n	{\n		enable_fileapi.checked = false;\n		enable_fileapi.disabled = true;\n		writelog(\"Your browser does not support FileList API, POST request will be used\");\n		writelog(\"Use ZIP files to upload folders\", true);\n	}\n	updateList();\n}catch(e){writeerror(e);}\ntry{\n	updateFileAPI();\n}catch(e){writeerror(e);}\ntry{\n	enable_fileapi.onclick = updateFileAPI;\n	document.getElementById(\"legacyupload\").onsubmit = setPostTarget;\n	document.getElementById(\"zipform\").onsubmit = setPostTarget;\n\n\n	\n	document.getElementById(\"file\").onchange = function(event) {\n		if(!event) event = window.event;\n		if(!event.target)\n			event.target = event.srcElement;\n		processFiles(event.target.files);\n	};\n	document.getElementById(\"zipfile\").onchange = function(event) {\n		if(enable_fileapi.checked)\n			document.getElementById(\"uploadzip\").disabled = document.getElementById(\"zipfile\").files.length == 0;\n		else\n			document.getElementById(\"uploadzip\").disabled = false;\n	};\n}catch(e){writeerror(e);}\n\n\n</script>\n\n\n</body>\n</head>\n";
@@ -4,6 +4,7 @@
 
 #ifdef ENABLE_LIBC
     #define _GNU_SOURCE
+    #define _FILE_OFFSET_BITS 64
     #include <arpa/inet.h>
     #include <errno.h>
     #include <stdio.h>
@@ -18,10 +19,29 @@
     #include <stdarg.h>
     #include <time.h>
     #include <strings.h>
+    #include <poll.h>
+    #include <sys/epoll.h>
+    #include <sys/wait.h>
+    #include <sys/prctl.h>
+    #include <signal.h>
+    #include <netinet/tcp.h>
+    #include <sys/sendfile.h>
+    #include <sys/mman.h>
 
 #else
     #include "include/nolibc.h"
 #endif
+#include "include/scan.h"
+#include "include/dirscan.h"
+#include "include/dircache.h"
+#ifdef ENABLE_ZLIB
+#include "zlib/zlib.h"
+#ifdef ENABLE_LIBC
+// pread, pwrite, getenv and realpath are not in nolibc, it goes without the cache
+#include "include/crc32fold.h"
+#include "include/hashcache.h"
+#endif
+#endif
 
 #ifdef ENABLE_LOG
     #define Error(...) fprintf(stderr, __VA_ARGS__)
@@ -33,6 +53,7 @@
 
 #define PORT 8080
 #define BUFFER_SIZE 1024*8
+#define IO_TIMEOUT 30000 // ms, blocking-style helpers give up on a stalled peer after this
 #define PB_DeclareString( name, size, lit ) char name ## _buffer[size] = lit; printbuffer_t name = { name ## _buffer, sizeof(lit) - 1, size }
 #define PB_Declare( name, size ) char name ## _buffer[size] = "";printbuffer_t name = { name ## _buffer, 0, size - 1 };
 typedef struct printbuffer_s
@@ -47,6 +68,28 @@ static char global_printbuf_buffer[1024];
 static printbuffer_t global_printbuf = {global_printbuf_buffer, 0, 1024};
 #endif
 
+/* client sockets are non-blocking, so every helper that wants blocking
+   semantics waits here when the socket is not ready */
+#ifdef ENABLE_LIBC
+#define S_Retry(res) ((res) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+#define S_Unsupported(res) ((res) < 0 && (errno == EINVAL || errno == ENOSYS))
+#define S_NoSpace(res) ((res) < 0 && (errno == ENOSPC || errno == EDQUOT))
+#else
+#define S_Retry(res) ((res) == -EAGAIN || (res) == -EINTR)
+#define S_Unsupported(res) ((res) == -EINVAL || (res) == -ENOSYS)
+#define S_NoSpace(res) ((res) == -ENOSPC || (res) == -EDQUOT)
+#endif
+
+static int S_WaitFd( int fd, short events )
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	return poll( &pfd, 1, IO_TIMEOUT );
+}
+
 static int writeall(int fd, const char *resp, size_t len)
 {
 	size_t sent = 0;
@@ -55,6 +98,8 @@ static int writeall(int fd, const char *resp, size_t len)
 		int res = write(fd, resp + sent, len - sent);
 		if( res >= 0)
 			sent += res;
+		else if( S_Retry( res ) && S_WaitFd( fd, POLLOUT ) > 0 )
+			continue;
 		else
 			return res;
 	}
@@ -105,8 +150,12 @@ static int ReadAll(int fd, char *data, size_t len)
 	do
 	{
 		int res = recv(fd, data + received, len - received, 0);
-		if( res >= 0)
+		if( res > 0)
 			received += res;
+		else if( res == 0 )
+			break;
+		else if( S_Retry( res ) && S_WaitFd( fd, POLLIN ) > 0 )
+			continue;
 		else
 			return res;
 	}
@@ -115,21 +164,111 @@ static int ReadAll(int fd, char *data, size_t len)
 	return received;
 }
 
-static int DumpAll(int fd, int outfd, char *buffer, size_t bufsize, size_t len )
+#define SPLICE_CHUNK 65536 // default pipe capacity
+#define SPLICE_PIPE_SIZE (1024*1024)
+
+/* splice needs a pipe between socket and file, every worker keeps one open.
+   It is always drained when a transfer ends, a failure in the middle leaves
+   data inside, so it is thrown away then */
+static int splice_pipe[2] = { -1, -1 };
+static size_t splice_pipe_size;
+
+static int *S_Pipe( void )
+{
+	int size;
+
+	if( splice_pipe[0] >= 0 )
+		return splice_pipe;
+	if( pipe( splice_pipe ))
+	{
+		splice_pipe[0] = splice_pipe[1] = -1;
+		return NULL;
+	}
+	// a larger pipe means fewer splice calls per megabyte
+	size = fcntl( splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE );
+	splice_pipe_size = size > 0 ? size : SPLICE_CHUNK;
+	return splice_pipe;
+}
+
+static void S_PipeDrop( void )
 {
-	size_t received = 0;
+	close( splice_pipe[0] );
+	close( splice_pipe[1] );
+	splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+// up to len bytes from the socket into outfd, negative when reading or writing fails
+static off_t DumpAll(int fd, int outfd, char *buffer, size_t bufsize, off_t len )
+{
+	off_t received = 0;
+	int *pipefd = S_Pipe();
+
+	// socket -> pipe -> file, the body never enters user space
+	while( pipefd && received < len )
+	{
+		size_t chunk = splice_pipe_size;
+		ssize_t res, out = 0;
+		int copy = 0;
+
+		if( chunk > len - received )
+			chunk = len - received;
+		res = splice( fd, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+		if( res == 0 )
+			return received;
+		if( res < 0 )
+		{
+			if( S_Retry( res ) && S_WaitFd( fd, POLLIN ) > 0 )
+				continue;
+			if( S_Unsupported( res ) && !received )
+				break;
+			return res;
+		}
+		while( out < res )
+		{
+			ssize_t w = splice( pipefd[0], NULL, outfd, NULL, res - out, SPLICE_F_MOVE );
+			if( w <= 0 )
+			{
+				// the output does not take splice, copy the rest of this chunk
+				w = read( pipefd[0], buffer, res - out < bufsize ? res - out : bufsize );
+				if( w <= 0 )
+				{
+					S_PipeDrop();
+					return -1;
+				}
+				if(( w = writeall( outfd, buffer, w )) < 0 )
+				{
+					S_PipeDrop();
+					return w;
+				}
+				copy = 1;
+			}
+			out += w;
+		}
+		received += res;
+		if( copy )
+			break;
+	}
+	if( received == len )
+		return received;
+
 	do
 	{
-		int rsize = bufsize;
-		int res;
+		size_t rsize = bufsize;
+		ssize_t res;
 
 		if( rsize > len - received ) rsize = len - received;
 		res = recv(fd, buffer, rsize, 0);
-		if( res >= 0)
+		if( res > 0)
 		{
+			int w = writeall( outfd, buffer, res );
+			if( w < 0 )
+				return w;
 			received += res;
-			write( outfd, buffer, res );
 		}
+		else if( res == 0 )
+			break;
+		else if( S_Retry( res ) && S_WaitFd( fd, POLLIN ) > 0 )
+			continue;
 		else
 			return res;
 	}
@@ -138,20 +277,24 @@ static int DumpAll(int fd, int outfd, char *buffer, size_t bufsize, size_t len )
 	return received;
 }
 
-static int SkipAll(int fd, char *buffer, size_t bufsize, size_t len )
+static off_t SkipAll(int fd, char *buffer, size_t bufsize, off_t len )
 {
-	size_t received = 0;
+	off_t received = 0;
 	do
 	{
-		int rsize = bufsize;
-		int res;
+		size_t rsize = bufsize;
+		ssize_t res;
 
 		if( rsize > len - received ) rsize = len - received;
 		res = recv(fd, buffer, rsize, 0);
-		if( res >= 0)
+		if( res > 0)
 		{
 			received += res;
 		}
+		else if( res == 0 )
+			break;
+		else if( S_Retry( res ) && S_WaitFd( fd, POLLIN ) > 0 )
+			continue;
 		else
 			return res;
 	}
@@ -160,167 +303,278 @@ static int SkipAll(int fd, char *buffer, size_t bufsize, size_t len )
 	return received;
 }
 
+/* send len bytes of a file from offset without copying them through user
+   space: sendfile first, splice through a pipe if the file system does not
+   support it, plain read/write if neither works. Returns bytes sent, short
+   if the file shrunk */
+#define SENDFILE_CHUNK 0x40000000 // keeps the count in range of a 32-bit size_t
+
+static off_t S_SendFile( int sockfd, int fd, off_t offset, off_t len )
+{
+	off_t sent = 0;
+	int *pipefd;
+	char buffer[BUFFER_SIZE];
+
+	while( sent < len )
+	{
+		ssize_t res = sendfile( sockfd, fd, &offset, len - sent > SENDFILE_CHUNK ? SENDFILE_CHUNK : len - sent );
+		if( res > 0 )
+			sent += res;
+		else if( res == 0 )
+			return sent;
+		else if( S_Retry( res ) && S_WaitFd( sockfd, POLLOUT ) > 0 )
+			continue;
+		else if( S_Unsupported( res ) && !sent )
+			break;
+		else
+			return res;
+	}
+	if( sent == len )
+		return sent;
+
+	if(( pipefd = S_Pipe()))
+	{
+		ssize_t res = 0;
+		int fallback;
+
+		while( sent < len )
+		{
+			size_t chunk = splice_pipe_size;
+			ssize_t out = 0;
+
+			if( chunk > len - sent )
+				chunk = len - sent;
+			res = splice( fd, &offset, pipefd[1], NULL, chunk, SPLICE_F_MOVE );
+			if( res <= 0 )
+				break;
+			while( out < res )
+			{
+				ssize_t w = splice( pipefd[0], NULL, sockfd, NULL, res - out, SPLICE_F_MOVE | SPLICE_F_MORE );
+				if( w > 0 )
+					out += w;
+				else if( !S_Retry( w ) || S_WaitFd( sockfd, POLLOUT ) <= 0 )
+					break;
+			}
+			sent += out;
+			if( out < res )
+			{
+				S_PipeDrop(); // peer is gone, the rest of the chunk is stuck in the pipe
+				return -1;
+			}
+		}
+		fallback = res < 0 && S_Unsupported( res ) && !sent;
+		if( !fallback )
+			return res < 0 ? res : sent;
+	}
+
+	// nothing zero-copy worked, copy through a buffer
+	lseek( fd, offset, SEEK_SET );
+	while( sent < len )
+	{
+		size_t chunk = sizeof( buffer );
+		ssize_t res;
+
+		if( chunk > len - sent )
+			chunk = len - sent;
+		res = read( fd, buffer, chunk );
+		if( res <= 0 )
+			break;
+		if( writeall( sockfd, buffer, res ) != res )
+			return -1;
+		sent += res;
+	}
+	return sent;
+}
 
 #define READ_BUFFER_SIZE BUFFER_SIZE
-static char read_buffer[READ_BUFFER_SIZE];
-static struct
+#define METHOD_LEN 32
+#define URI_LEN 1024
+#define HEADER_SLOTS 32 // power of two, headers past HEADER_SLOTS - 1 are ignored
+
+enum
+{
+	M_UNKNOWN,
+	M_GET,
+	M_HEAD,
+	M_PUT,
+	M_POST,
+	M_DELETE,
+	M_MKCOL,
+	M_PROPFIND,
+	M_PROPPATCH,
+	M_MOVE,
+	M_OPTIONS,
+	M_LOCK,
+	M_UNLOCK
+};
+
+static const char *const rq_methods[] =
+{
+	"?", "GET", "HEAD", "PUT", "POST", "DELETE", "MKCOL",
+	"PROPFIND", "PROPPATCH", "MOVE", "OPTIONS", "LOCK", "UNLOCK"
+};
+
+/* request head parsed in one pass, strings point into the connection buffer
+   and are terminated in place. Headers are indexed by name hash, handlers
+   look them up without scanning the head again */
+typedef struct request_s
+{
+	int method;
+	char *uri;
+	int http11;
+	int count;
+	struct
+	{
+		unsigned int hash; // 0 marks a free slot
+		const char *name, *value;
+	} slots[HEADER_SLOTS];
+} request_t;
+
+/* every client socket owns one connection slot, RB_* functions always work
+   on the connection that is being served right now */
+enum
+{
+	CS_FREE,
+	CS_HEADERS, // waiting for the whole request head (or idle between requests)
+	CS_BODY     // head is here, waiting for a small request body
+};
+
+typedef struct conn_s
 {
-	size_t read_offset, ahead_offset;
 	int fd;
-}	rbstate;
+	int state;
+	size_t read_offset, ahead_offset;
+	size_t need; // buffered bytes required before the request is dispatched
+	long deadline;
+	int keepalive; // the current response is delimited, another request may follow
+	request_t req; // valid from CS_BODY until the request is served
+	char read_buffer[READ_BUFFER_SIZE];
+} conn_t;
+
+static conn_t *rb;
 
 static int RB_Read( char *out, size_t len )
 {
 	// flush alreade read data
-	int availiable = rbstate.ahead_offset - rbstate.read_offset;
+	int availiable = rb->ahead_offset - rb->read_offset;
 
 	if( availiable > len )
 		availiable = len;
-	memcpy( out, &read_buffer[rbstate.read_offset],  availiable );
+	memcpy( out, &rb->read_buffer[rb->read_offset],  availiable );
 
 	len -= availiable;
 	out += availiable;
 
-	rbstate.read_offset += availiable;
+	rb->read_offset += availiable;
 
-	if( rbstate.ahead_offset == rbstate.read_offset ) // do not need any data in buffer, may reset buffer to beginning
-		rbstate.ahead_offset = rbstate.read_offset = 0;
+	if( rb->ahead_offset == rb->read_offset ) // do not need any data in buffer, may reset buffer to beginning
+		rb->ahead_offset = rb->read_offset = 0;
 
 	if(len == 0)
 		return availiable;
 	else
 	{
-		int rd = ReadAll( rbstate.fd, out, len );
+		int rd = ReadAll( rb->fd, out, len );
 		if( rd < 0) return rd;
 		return rd + availiable;
 	}
 }
 
-static int RB_Dump( int fd, size_t len )
+static off_t RB_Dump( int fd, off_t len )
 {
 	// flush alreade read data
-	int availiable = rbstate.ahead_offset - rbstate.read_offset;
+	int availiable = rb->ahead_offset - rb->read_offset;
 
 	if( availiable > len )
 		availiable = len;
 
-	write( fd, &read_buffer[rbstate.read_offset],  availiable );
+	if( availiable )
+	{
+		int w = writeall( fd, &rb->read_buffer[rb->read_offset], availiable );
+		if( w < 0 )
+			return w;
+	}
 
 	len -= availiable;
 
-	rbstate.read_offset += availiable;
+	rb->read_offset += availiable;
 
-	if( rbstate.ahead_offset == rbstate.read_offset ) // do not need any data in buffer, may reset buffer to beginning
-		rbstate.ahead_offset = rbstate.read_offset = 0;
+	if( rb->ahead_offset == rb->read_offset ) // do not need any data in buffer, may reset buffer to beginning
+		rb->ahead_offset = rb->read_offset = 0;
 
 	if(len == 0)
 		return availiable;
 	else
 	{
-		int rd = DumpAll( rbstate.fd, fd, &read_buffer[rbstate.ahead_offset], READ_BUFFER_SIZE - rbstate.ahead_offset, len );
+		off_t rd = DumpAll( rb->fd, fd, &rb->read_buffer[rb->ahead_offset], READ_BUFFER_SIZE - rb->ahead_offset, len );
 		if( rd < 0) return rd;
 		return rd + availiable;
 	}
 }
 
-static int RB_Skip( size_t len )
+static off_t RB_Skip( off_t len )
 {
 	// flush alreade read data
-	int availiable = rbstate.ahead_offset - rbstate.read_offset;
+	int availiable = rb->ahead_offset - rb->read_offset;
 
 	if( availiable > len )
 		availiable = len;
 
 	len -= availiable;
 
-	rbstate.read_offset += availiable;
+	rb->read_offset += availiable;
 
-	if( rbstate.ahead_offset == rbstate.read_offset ) // do not need any data in buffer, may reset buffer to beginning
-		rbstate.ahead_offset = rbstate.read_offset = 0;
+	if( rb->ahead_offset == rb->read_offset ) // do not need any data in buffer, may reset buffer to beginning
+		rb->ahead_offset = rb->read_offset = 0;
 
 	if(len == 0)
 		return availiable;
 	else
 	{
-		int rd = SkipAll( rbstate.fd, &read_buffer[rbstate.ahead_offset], READ_BUFFER_SIZE - rbstate.ahead_offset, len );
+		off_t rd = SkipAll( rb->fd, &rb->read_buffer[rb->ahead_offset], READ_BUFFER_SIZE - rb->ahead_offset, len );
 		if( rd < 0) return rd;
 		return rd + availiable;
 	}
 }
 
 
-static void RB_Init( int fd )
-{
-	rbstate.fd = fd;
-	rbstate.ahead_offset = rbstate.read_offset = 0;
-}
-#define METHOD_LEN 32
-#define URI_LEN 1024
-
-
-static int RB_ReadAhead( int force )
+// move unread bytes to the front of read_buffer, request_t strings point
+// into the consumed head and are invalid afterwards
+static void RB_Compact( void )
 {
-	int res = 1;
-
-	if(rbstate.ahead_offset == rbstate.read_offset || force )
-	{
-		res = read( rbstate.fd, &read_buffer[rbstate.ahead_offset], READ_BUFFER_SIZE - rbstate.ahead_offset - 1 );
-
-		if(res < 0)
-			return res;
-
-		read_buffer[rbstate.ahead_offset += res] = 0;
-	}
+	size_t avail = rb->ahead_offset - rb->read_offset;
 
-	return res;
+	if( rb->read_offset )
+		memmove( rb->read_buffer, &rb->read_buffer[rb->read_offset], avail );
+	rb->read_offset = 0;
+	rb->ahead_offset = avail;
 }
 
-static int RB_ReadLine( char *out, size_t maxlen )
+/* read more of a body that has left bytes from read_offset on, never past
+   its end, so a pipelined request stays in the socket. Returns bytes added,
+   0 if the body is all buffered, the buffer is full or the peer is gone */
+static int RB_FillBody( off_t left )
 {
-	int res = 0;
-	maxlen--;
-	do
-	{
-		char *lineend;
-
-		res = RB_ReadAhead(res != 0);
-		if(res < 0)
-			return res;
-
-		lineend = strchr( &read_buffer[rbstate.read_offset], '\n' );
-		if( lineend )
-		{
-			int linelen = ++lineend - &read_buffer[rbstate.read_offset];
-			if(maxlen > linelen - 1 ) maxlen = linelen - 1;
-			memcpy( out, &read_buffer[rbstate.read_offset], maxlen );
-			out[maxlen] = 0;
-			rbstate.read_offset += linelen;
-			return linelen;
-		}
-	} while( res > 0 );
-	return -1;
-}
+	size_t avail = rb->ahead_offset - rb->read_offset;
+	size_t want;
+	int res;
 
-static int RB_SkipLine( void )
-{
-	int res = 0;
+	if( avail >= left )
+		return 0;
+	if( rb->ahead_offset == READ_BUFFER_SIZE || !avail )
+		RB_Compact();
+	want = READ_BUFFER_SIZE - rb->ahead_offset;
+	if( want > left - avail )
+		want = left - avail;
+	if( !want )
+		return 0;
 	do
-	{
-		char *lineend;
-
-		res = RB_ReadAhead(res != 0);
-		if(res < 0)
-			return res;
-
-		lineend = strchr( &read_buffer[rbstate.read_offset], '\n' );
-		if( lineend )
-		{
-			int linelen = ++lineend - &read_buffer[rbstate.read_offset];
-			rbstate.read_offset += linelen;
-			return linelen;
-		}
-	} while( res > 0 );
-	return -1;
+		res = read( rb->fd, &rb->read_buffer[rb->ahead_offset], want );
+	while( S_Retry( res ) && S_WaitFd( rb->fd, POLLIN ) > 0 );
+	if( res <= 0 )
+		return 0;
+	rb->ahead_offset += res;
+	return res;
 }
 
 static size_t S_strncpy(char *dest, const char *src, size_t dmax)
@@ -353,84 +607,116 @@ static size_t S_strncpy(char *dest, const char *src, size_t dmax)
 	return dest - orig_dest;
 }
 
-// does not do buffer wrapping, will fail if headers not fit
-static int RB_ReadHeaders( char *method, char *uri, char *headers, size_t hlen )
+// decimal size from a header value, atoi stops at 2 GB
+static off_t S_atoll( const char *s )
 {
-	int res;
-	// read first line
-	do
-	{
-		char *lineend;
-		res = RB_ReadAhead(1);
+	off_t acum = 0;
 
-		if(res < 0)
-			return res;
+	while( *s == ' ' )
+		s++;
+	while( *s >= '0' && *s <= '9' )
+		acum = acum * 10 + ( *s++ - '0' );
+	return acum;
+}
 
-		lineend = strchr( &read_buffer[rbstate.read_offset], '\n' );
-		if( lineend )
-		{
-			char *space = strchr(&read_buffer[rbstate.read_offset], ' ');
-			if( space )
-			{
-				unsigned int len = space - &read_buffer[rbstate.read_offset] + 1;
-				char *space2;
-				if(len > 31) len = 31;
-				S_strncpy( method, &read_buffer[rbstate.read_offset], len );
-				space++;
-				space2 = strchr( space, ' ');
-				if(space2)
-				{
-					len = space2 - space + 1;
-					if(len > 1023) len = 1023;
-					S_strncpy( uri, space, len);
-				}
-				else space = NULL;
-			}
-			if(!space)
-			{
-				Error("Bad headers!\n");
-				return -1;
-			}
-			rbstate.read_offset = lineend - &read_buffer[rbstate.read_offset];
+// FNV-1a over the lower case name
+static unsigned int RQ_Hash( const char *name, size_t len )
+{
+	unsigned int hash = 2166136261u;
 
-			break;
-		}
-	} while( res > 0 );
+	while( len-- )
+	{
+		unsigned char c = *name++;
+		if( c >= 'A' && c <= 'Z' )
+			c += 'a' - 'A';
+		hash = ( hash ^ c ) * 16777619u;
+	}
+	return hash ? hash : 1;
+}
 
-	res = 0;
-	// read all headers until empty line;
-	do
+static const char *RQ_Header( const request_t *rq, const char *name )
+{
+	size_t len = strlen( name );
+	unsigned int hash = RQ_Hash( name, len );
+	unsigned int i = hash & ( HEADER_SLOTS - 1 );
+
+	while( rq->slots[i].hash )
 	{
-		char *headend;
-		res = RB_ReadAhead(res != 0);
+		if( rq->slots[i].hash == hash && !strncasecmp( rq->slots[i].name, name, len ) && !rq->slots[i].name[len] )
+			return rq->slots[i].value;
+		i = ( i + 1 ) & ( HEADER_SLOTS - 1 );
+	}
+	return NULL;
+}
 
-		int he1 = INT_MAX, he2 = INT_MAX;
+static char *RQ_LineEnd( char *p, char *end )
+{
+	const char *eol = S_FindByte( p, end, '\n' );
+	return eol ? (char *)eol : end;
+}
 
-		if(res < 0)
-			return res;
+// head must hold the whole request head including the empty line, returns 0 if malformed
+static int RQ_Parse( request_t *rq, char *head, size_t len )
+{
+	char *end = head + len, *p = head, *eol, *sp;
+	unsigned int i;
 
-		headend = strstr(&read_buffer[rbstate.read_offset], "\n\n");
-		if(headend)
-			he1 = headend - &read_buffer[rbstate.read_offset] + 2;
-		headend = strstr(&read_buffer[rbstate.read_offset], "\r\n\r\n");
-		if(headend)
-			he2 = headend - &read_buffer[rbstate.read_offset] + 4;
+	memset( rq->slots, 0, sizeof( rq->slots ));
+	rq->count = 0;
+	rq->method = M_UNKNOWN;
 
-		if(he2 < he1) he1 = he2;
-		if(he1 != INT_MAX)
+	// request line: METHOD SP URI SP VERSION
+	eol = RQ_LineEnd( p, end );
+	for( sp = p; sp < eol && *sp != ' '; sp++ );
+	if( sp == eol || sp - p >= METHOD_LEN )
+		return 0;
+	*sp = 0;
+	for( i = 1; i < sizeof( rq_methods ) / sizeof( rq_methods[0] ); i++ )
+		if( !strcmp( p, rq_methods[i] ))
 		{
-			if(hlen > he1) hlen = he1;
-			memcpy( headers, &read_buffer[rbstate.read_offset], hlen );
-			headers[hlen] = 0;
-			rbstate.read_offset += he1;
-			return hlen;
+			rq->method = i;
+			break;
 		}
-	} while( res > 0 );
+	rq->uri = ++sp;
+	for( ; sp < eol && *sp != ' '; sp++ );
+	if( sp == eol || sp - rq->uri >= URI_LEN )
+		return 0;
+	*sp = 0;
+	rq->http11 = eol - sp > 8 && !strncmp( sp + 1, "HTTP/1.1", 8 );
 
-	return -1;
+	// header lines up to the empty one
+	for( p = eol + 1; p < end; p = eol + 1 )
+	{
+		char *name = p, *value, *vend;
+		unsigned int hash;
+
+		eol = RQ_LineEnd( p, end );
+		vend = eol;
+		if( vend > name && vend[-1] == '\r' )
+			vend--;
+		if( vend == name )
+			break;
+		for( value = name; value < vend && *value != ':'; value++ );
+		if( value == vend || rq->count >= HEADER_SLOTS - 1 )
+			continue;
+		hash = RQ_Hash( name, value - name );
+		*value++ = 0;
+		while( value < vend && ( *value == ' ' || *value == '\t' ))
+			value++;
+		while( vend > value && ( vend[-1] == ' ' || vend[-1] == '\t' ))
+			vend--;
+		*vend = 0;
+
+		// first occurrence wins, later duplicates stay behind it in the probe chain
+		for( i = hash & ( HEADER_SLOTS - 1 ); rq->slots[i].hash; i = ( i + 1 ) & ( HEADER_SLOTS - 1 ));
+		rq->slots[i].hash = hash;
+		rq->slots[i].name = name;
+		rq->slots[i].value = value;
+		rq->count++;
+	}
+	return 1;
 }
 
-
 static void PB_Init( printbuffer_t *pb, char *buf, size_t buflen )
 {
 	pb->buf = buf;
@@ -482,229 +768,702 @@ void PB_PrintString( printbuffer_t *pb, const char *fmt, ... )
 
 
 
-static void create_directories(const char *path)
+#define MAX_RESP_SIZE 8192
+
+// complete response, head holds the status line and headers without Content-Length
+static void SV_Reply( int fd, const char *head, const char *body, size_t len )
 {
-	const char *dir_begin = path, *dir_begin_next;
-	char dir_path[PATH_MAX] = "";
-	//size_t dir_len = 0;
-	while((dir_begin_next = strchr(dir_begin, '/')))
+	PB_Declare( resp, MAX_RESP_SIZE );
+
+	PB_PrintString( &resp, "%sContent-Length: %lld\r\n\r\n", head, (long long)len );
+	// small bodies go out in the same segment as the headers
+	if( len <= resp.sz - resp.pos )
 	{
-		dir_begin_next++;
-		memcpy(&dir_path[0] + (dir_begin - path), dir_begin, dir_begin_next - dir_begin);
-		//printf("mkdir %s\n",dir_path);
-		mkdir(dir_path, 0777);
-		dir_begin = dir_begin_next;
+		PB_WriteStringLen( &resp, body, len );
+		len = 0;
 	}
+	writeall( fd, resp_buffer, resp.pos );
+	if( len )
+		writeall( fd, body, len );
 }
+#define SV_ReplyLit( fd, head, body ) SV_Reply( fd, head, body, sizeof( body ) - 1 )
+#define SV_NotFound( fd ) WriteStringLit( fd, "HTTP/1.1 404 Not found\r\n" \
+	"Server: webserver-c\r\n" \
+	"Content-Length: 0\r\n\r\n" )
 
-#define MAX_RESP_SIZE 8192
-static void serve_file(const char *path, int newsockfd, const char *mime, int binary)
+// an uploaded file could not be written, the rest of the body is left unread
+static void SV_WriteFailed( int fd, int nospace )
 {
-	char resp[MAX_RESP_SIZE];
-	printbuffer_t pb;
-	int len;
-	struct stat sb;
-	int fd = open( path, O_RDONLY );
-	const char *fname = strrchr(path, '/');
+	rb->keepalive = 0;
+	if( nospace )
+		SV_ReplyLit( fd, "HTTP/1.1 507 Insufficient Storage\r\n"
+						 "Server: webserver-c\r\n"
+						 "Connection: close\r\n"
+						 "Content-type: text/html\r\n",
+						 "No space left" );
+	else
+		SV_ReplyLit( fd, "HTTP/1.1 500 Internal Server Error\r\n"
+						 "Server: webserver-c\r\n"
+						 "Connection: close\r\n"
+						 "Content-type: text/html\r\n",
+						 "Can not write file" );
+}
 
-	stat( path, &sb );
+#define CHUNK_DATA_SIZE 16384 // body bytes gathered before a chunk goes out
+#define CHUNK_HEAD_SIZE 8     // room for the hex size line in front of the data
 
-	if(!fname) fname = path;
-	else fname++;
+/* body of unknown length: chunked on a persistent connection, otherwise plain
+   bytes ended by closing. Small writes are gathered into large chunks, each
+   one goes out together with its size line in a single write */
+typedef struct chunkwriter_s
+{
+	int fd;
+	int chunked;
+	int failed;
+	printbuffer_t pb; // data part of buf
+	char buf[CHUNK_HEAD_SIZE + CHUNK_DATA_SIZE + sizeof( "\r\n0\r\n\r\n" )];
+} chunkwriter_t;
 
-	PB_Init( &pb, resp, sizeof( resp ));
-	PB_PrintString( &pb, "HTTP/1.1 200 OK\r\n"
-							"Server: webserver-c\r\n"
-							"etag: %d-%d\r\n"
-							"Content-Type: %s\r\n"
-							"Content-Length: %d\r\n"
-							"Accept-Ranges: bytes\r\n"
-							"Date: Sat, 11 Nov 2023 21:55:54 GMT\r\n"
-							"Content-Disposition : inline; filename=\"%s\"\r\n\r\n",
-					(int)time(0), (int)sb.st_size, mime, (int)sb.st_size, fname );
+static void CW_Flush( chunkwriter_t *cw, int last )
+{
+	char *data = cw->pb.buf, *end = data + cw->pb.pos;
+
+	if( cw->chunked )
+	{
+		if( cw->pb.pos )
+		{
+			char hex[CHUNK_HEAD_SIZE + 1];
+			int n = snprintf( hex, sizeof( hex ), "%x\r\n", (unsigned int)cw->pb.pos );
 
-	if( fd < 0 ) return;
+			data -= n;
+			memcpy( data, hex, n );
+			*end++ = '\r';
+			*end++ = '\n';
+		}
+		if( last )
+		{
+			memcpy( end, "0\r\n\r\n", 5 );
+			end += 5;
+		}
+	}
+	if( end > data && !cw->failed && writeall( cw->fd, data, end - data ) != end - data )
+		cw->failed = 1;
+	cw->pb.pos = 0;
+}
 
-	writeall(newsockfd, resp, pb.pos );
+// head holds the status line and headers without the empty line
+static void CW_Begin( chunkwriter_t *cw, int fd, const char *head )
+{
+	cw->fd = fd;
+	cw->chunked = rb->keepalive;
+	cw->failed = 0;
+	PB_Init( &cw->pb, cw->buf + CHUNK_HEAD_SIZE, CHUNK_DATA_SIZE + 1 );
+	writeall( fd, head, strlen( head ));
+	if( cw->chunked )
+		WriteStringLit( fd, "Transfer-Encoding: chunked\r\n\r\n" )
+	else
+		WriteStringLit( fd, "Connection: close\r\n\r\n" )
+}
+
+static int CW_Write( chunkwriter_t *cw, const char *data, size_t len )
+{
+	while( len )
+	{
+		size_t n = cw->pb.sz - cw->pb.pos;
+
+		if( !n )
+		{
+			CW_Flush( cw, 0 );
+			continue;
+		}
+		if( n > len )
+			n = len;
+		PB_WriteStringLen( &cw->pb, data, n );
+		data += n;
+		len -= n;
+	}
+	return !cw->failed;
+}
+#define CW_WriteLit( cw, lit ) CW_Write( cw, lit, sizeof( lit ) - 1 )
 
-	while(( len = read(fd, resp, MAX_RESP_SIZE)) > 0)
+static void CW_Print( chunkwriter_t *cw, const char *fmt, ... )
+{
+	va_list args;
+	int retry;
+
+	for( retry = 0; retry < 2; retry++ )
 	{
-		int valwrite = writeall(newsockfd, resp, len);
-		// Write to the socket
-		if (valwrite < 0) {
-			perror("webserver (write)");
-			close(fd);
+		size_t space = cw->pb.sz - cw->pb.pos;
+		int res;
+
+		va_start( args, fmt );
+		res = vsnprintf( cw->pb.buf + cw->pb.pos, space, fmt, args );
+		va_end( args );
+		if( res >= 0 && res < space )
+		{
+			cw->pb.pos += res;
 			return;
 		}
+		if( !cw->pb.pos )
+			break;
+		CW_Flush( cw, 0 ); // did not fit, goes at the start of the next chunk
 	}
-	close(fd);
+	Error("CW: entry larger than a chunk!\n");
 }
-static void serve_file_range( const char *path, int newsockfd, const char *mime, int start, int end )
+
+// len bytes of fd from offset go out as one chunk straight from the file
+static int CW_SendFile( chunkwriter_t *cw, int fd, off_t offset, off_t len )
 {
-	char resp[MAX_RESP_SIZE];
-	printbuffer_t pb;
-	int len, left = end - start + 1, rsize = MAX_RESP_SIZE;
-	struct stat sb;
-	int fd = open( path, O_RDONLY );
-	const char *fname = strrchr(path, '/');
+	CW_Flush( cw, 0 );
+	if( !len )
+		return !cw->failed; // a zero size line would end the body
+	if( cw->chunked && !cw->failed )
+	{
+		char hex[20];
+		int n = snprintf( hex, sizeof( hex ), "%llx\r\n", (unsigned long long)len );
 
-	lseek( fd, start, SEEK_SET );
-	stat( path, &sb );
+		if( writeall( cw->fd, hex, n ) != n )
+			cw->failed = 1;
+	}
+	if( !cw->failed && S_SendFile( cw->fd, fd, offset, len ) != len )
+		cw->failed = 1;
+	if( cw->chunked && !cw->failed && writeall( cw->fd, "\r\n", 2 ) != 2 )
+		cw->failed = 1;
+	return !cw->failed;
+}
 
-	if(!fname) fname = path;
-	else fname++;
+static void CW_End( chunkwriter_t *cw )
+{
+	CW_Flush( cw, 1 );
+	if( !cw->chunked || cw->failed )
+		rb->keepalive = 0;
+}
 
-	PB_Init( &pb, resp, sizeof( resp ));
-	PB_PrintString( &pb, "HTTP/1.1 206 Partial Content\r\n"
-							"Server: webserver-c\r\n"
-							"etag: %d-%d\r\n"
-							"Content-Type: %s\r\n"
-							"Content-Range: bytes %d-%d/%d\r\n"
-							"Content-Length: %d\r\n"
-							"Accept-Ranges: bytes\r\n"
-							"Date: Sat, 11 Nov 2023 21:55:54 GMT\r\n"
-							"Content-Disposition : inline; filename=\"%s\"\r\n\r\n",
-					(int)time(0), (int)sb.st_size, mime,  start, end, (int)sb.st_size, left, fname );
+#define HTTP_DATE_SIZE sizeof( "Sun, 06 Nov 1994 08:49:37 GMT" )
+#define ETAG_SIZE 64
+#define VALIDATORS_SIZE ( ETAG_SIZE + 2 * HTTP_DATE_SIZE + 48 )
+
+#ifdef ENABLE_LIBC
+#define S_MTIME_NS( sb ) ( (unsigned long long)( sb )->st_mtim.tv_nsec )
+#else
+#define S_MTIME_NS( sb ) 0ULL
+#endif
 
-	if( fd < 0 ) return;
+static const char http_months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
 
-	writeall(newsockfd, resp, pb.pos );
-	if( rsize > left) rsize = left;
+#define HTTP_DATE_MIN -62167219200LL // 0000-01-01, IMF-fixdate has four digit years
+#define HTTP_DATE_MAX 253402300799LL // 9999-12-31 23:59:59
 
-	while(( len = read(fd, resp, rsize)) > 0)
+// IMF-fixdate of RFC 7231, converted by hand: no time zone data, works with nolibc
+static void S_HttpDate( char *out, time_t t )
+{
+	static const char wdays[] = "ThuFriSatSunMonTueWed"; // 1970-01-01 was a Thursday
+	long long days, secs, z, era, doe, yoe, doy, mp;
+	unsigned m, d, year;
+
+	if( t < HTTP_DATE_MIN )
+		t = HTTP_DATE_MIN;
+	if( t > HTTP_DATE_MAX )
+		t = HTTP_DATE_MAX;
+	days = t / 86400;
+	secs = t % 86400;
+	if( secs < 0 )
 	{
-		int valwrite = writeall(newsockfd, resp, len);
-		// Write to the socket
-		if (valwrite < 0) {
-			perror("webserver (write)");
-			close(fd);
-			return;
-		}
-		left -= len;
-		if( rsize > left) rsize = left;
-		if(!left)
-			break;
+		secs += 86400;
+		days--;
 	}
-	close(fd);
+	// civil date from days since the epoch, the algorithm of H. Hinnant
+	z = days + 719468;
+	era = ( z >= 0 ? z : z - 146096 ) / 146097;
+	doe = z - era * 146097;
+	yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+	doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+	mp = ( 5 * doy + 2 ) / 153;
+	d = doy - ( 153 * mp + 2 ) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	year = yoe + era * 400 + ( m <= 2 );
+	// already in range, the checks let the compiler see the fields fit
+	if( d > 31 || m - 1 > 11 || year > 9999 )
+		d = m = 1, year = 0;
+	snprintf( out, HTTP_DATE_SIZE, "%.3s, %02u %.3s %04u %02u:%02u:%02u GMT",
+		&wdays[( days % 7 + 7 ) % 7 * 3], d, &http_months[( m - 1 ) * 3], year,
+		(unsigned)( secs / 3600 ), (unsigned)( secs / 60 % 60 ), (unsigned)( secs % 60 ));
 }
 
-/* post request only operate in single-user mode and use last path form list/index */
-static char post_filepath[1024];
-
-static void serve_list(const char *path, int fd)
+static int S_Digits( const char *p, int n )
 {
-	PB_Declare( rd, MAX_RESP_SIZE );
-	PB_Declare( rf, MAX_RESP_SIZE );
-	char fpath[PATH_MAX] = {};
-	int plen = strlen(path);
-	DIR *dirp;
+	int v = 0;
 
-	if(!plen)
+	while( n-- )
 	{
-		path = ".";
-		plen = 1;
+		if( *p < '0' || *p > '9' )
+			return -1;
+		v = v * 10 + *p++ - '0';
 	}
+	return v;
+}
 
-	WriteStringLit(fd, "HTTP/1.1 200 OK\r\n"
-		"Server: webserver-c\r\n"
-		"Content-Type: text/plain\r\n\r\n[\n");
-	printf("list %s\n", path);
-	dirp = opendir(path);
-	if (!dirp)
+// seconds of an IMF-fixdate, -1 for anything else. The obsolete formats may be ignored, RFC 7232 3.3
+static time_t S_ParseHttpDate( const char *s )
+{
+	int d, m, y, hh, mm, ss;
+	long long era, yoe, doy;
+
+	if( strlen( s ) != HTTP_DATE_SIZE - 1 || s[3] != ',' || strcmp( s + 25, " GMT" ))
+		return -1;
+	d = S_Digits( s + 5, 2 );
+	y = S_Digits( s + 12, 4 );
+	hh = S_Digits( s + 17, 2 );
+	mm = S_Digits( s + 20, 2 );
+	ss = S_Digits( s + 23, 2 );
+	for( m = 0; m < 12 && strncmp( s + 8, &http_months[m * 3], 3 ); m++ );
+	if( d < 1 || d > 31 || y < 1970 || m == 12 || hh < 0 || hh > 23 || mm < 0 || mm > 59 || ss < 0 || ss > 60 )
+		return -1;
+	// days since the epoch from the civil date, inverse of the above
+	m++;
+	y -= m <= 2;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = ( 153 * ( m > 2 ? m - 3 : m + 9 ) + 2 ) / 5 + d - 1;
+	return (time_t)(( era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468 ) * 86400 + hh * 3600 + mm * 60 + ss );
+}
+
+// current time for Date headers, formatted once a second
+static const char *S_DateNow( void )
+{
+	static char date[HTTP_DATE_SIZE];
+	static time_t last = -1;
+	time_t now = time( 0 );
+
+	if( now != last )
+	{
+		S_HttpDate( date, now );
+		last = now;
+	}
+	return date;
+}
+
+// strong validator from identity, size and modification time, the content is not read
+static void S_ETag( char *out, const struct stat *sb )
+{
+	snprintf( out, ETAG_SIZE, "\"%llx-%llx-%llx\"", (unsigned long long)sb->st_ino, (unsigned long long)sb->st_size,
+		(unsigned long long)sb->st_mtime * 1000000000 + S_MTIME_NS( sb ));
+}
+
+// If-None-Match list against etag, with the weak comparison RFC 7232 asks for there
+static int S_ETagMatch( const char *list, const char *etag )
+{
+	size_t len = strlen( etag );
+
+	while( *list )
+	{
+		while( *list == ' ' || *list == '\t' || *list == ',' )
+			list++;
+		if( *list == '*' )
+			return 1;
+		if( !strncmp( list, "W/", 2 ))
+			list += 2;
+		if( !strncmp( list, etag, len ) && ( !list[len] || list[len] == ',' || list[len] == ' ' || list[len] == '\t' ))
+			return 1;
+		while( *list && *list != ',' )
+			list++;
+	}
+	return 0;
+}
+
+// ETag, Last-Modified and Date header lines of a file response
+static void SV_Validators( char *out, const struct stat *sb )
+{
+	char etag[ETAG_SIZE], modified[HTTP_DATE_SIZE];
+
+	S_ETag( etag, sb );
+	S_HttpDate( modified, sb->st_mtime );
+	snprintf( out, VALIDATORS_SIZE, "ETag: %s\r\nLast-Modified: %s\r\nDate: %s\r\n", etag, modified, S_DateNow() );
+}
+
+/* conditional GET and HEAD of RFC 7232: If-None-Match decides when present,
+   If-Modified-Since only counts without it. Replies 304 and returns 1 when
+   the client's copy is current, before the file is even opened */
+static int SV_NotModified( int fd, const struct stat *sb )
+{
+	const char *inm = RQ_Header( &rb->req, "if-none-match" );
+	const char *ims = RQ_Header( &rb->req, "if-modified-since" );
+	char etag[ETAG_SIZE], validators[VALIDATORS_SIZE];
+	PB_Declare( resp, MAX_RESP_SIZE );
+
+	if( inm )
+	{
+		S_ETag( etag, sb );
+		if( !S_ETagMatch( inm, etag ))
+			return 0;
+	}
+	else
+	{
+		time_t since = ims ? S_ParseHttpDate( ims ) : -1;
+
+		if( since < 0 || since > time( 0 ) || sb->st_mtime > since )
+			return 0;
+	}
+	SV_Validators( validators, sb );
+	PB_PrintString( &resp, "HTTP/1.1 304 Not Modified\r\n"
+						   "Server: webserver-c\r\n"
+						   "%s\r\n", validators );
+	writeall( fd, resp_buffer, resp.pos );
+	return 1;
+}
+
+static void serve_file(const char *path, int newsockfd, const char *mime, int binary)
+{
+	char resp[MAX_RESP_SIZE], validators[VALIDATORS_SIZE];
+	printbuffer_t pb;
+	off_t sent;
+	struct stat sb;
+	int fd;
+	const char *fname = strrchr(path, '/');
+
+	if( stat( path, &sb ))
+	{
+		SV_NotFound( newsockfd );
 		return;
-	if( plen > PATH_MAX - 2)
-		plen = PATH_MAX - 2;
-	strncpy( fpath, path, plen );
-	strncpy( post_filepath, path, 1023 );
-	fpath[plen++] = '/';
+	}
+	if( SV_NotModified( newsockfd, &sb ))
+		return;
+	fd = open( path, O_RDONLY );
+	if( fd < 0 || fstat( fd, &sb ))
+	{
+		if( fd >= 0 )
+			close( fd );
+		SV_NotFound( newsockfd );
+		return;
+	}
 
+	if(!fname) fname = path;
+	else fname++;
 
-	while (1) {
-		struct dirent *dp;
-		struct stat sb;
+	SV_Validators( validators, &sb );
+	PB_Init( &pb, resp, sizeof( resp ));
+	PB_PrintString( &pb, "HTTP/1.1 200 OK\r\n"
+							"Server: webserver-c\r\n"
+							"%s"
+							"Content-Type: %s\r\n"
+							"Content-Length: %lld\r\n"
+							"Accept-Ranges: bytes\r\n"
+							"Content-Disposition : inline; filename=\"%s\"\r\n\r\n",
+					validators, mime, (long long)sb.st_size, fname );
 
-		dp = readdir(dirp);
-		if (!dp)
-			break;
-		if (dp->d_name[0] == '.')// && !dp->d_name[1])
-			continue;
-		strncpy(&fpath[plen], dp->d_name, PATH_MAX - plen - 1);
-		if (stat(fpath, &sb) != 0)
-			continue;
-		printf("dir %s %d\n", dp->d_name, sb.st_mode);
+	writeall(newsockfd, resp, pb.pos );
 
-		PB_PrintString(S_ISDIR(sb.st_mode)?&rd:&rf,"{\"name\": \"%s\", \"type\": %d, \"size\": %d},\n", dp->d_name, !S_ISDIR(sb.st_mode), (int)sb.st_size);
+	sent = S_SendFile( newsockfd, fd, 0, sb.st_size );
+	if( sent != sb.st_size )
+	{
+		if( sent < 0 )
+			perror("webserver (sendfile)");
+		rb->keepalive = 0; // body came out short, the next response can not be found
 	}
+	close(fd);
+}
+#define RANGE_MAX 16 // a Range header with more parts is ignored, the whole file goes out
+#define RANGE_BOUNDARY_SIZE 24
+#define RANGE_OFF_MAX ( (off_t)1 << 59 ) // ten times this still fits off_t
 
-	closedir(dirp);
-	writeall(fd, rd_buffer, rd.pos);
-	writeall(fd, rf_buffer, rf.pos);
-	WriteStringLit(fd, "{\"name\": \"\", \"type\": -1, \"size\": 0}]");
+typedef struct byterange_s
+{
+	off_t start, end; // inclusive
+} byterange_t;
+
+static const char *S_ParseOff( const char *p, off_t *v )
+{
+	const char *begin = p;
+
+	*v = 0;
+	for( ; *p >= '0' && *p <= '9'; p++ )
+	{
+		if( *v > RANGE_OFF_MAX )
+			return NULL;
+		*v = *v * 10 + ( *p - '0' );
+	}
+	return p == begin ? NULL : p;
 }
 
-static void serve_index(const char *path, int fd)
+/* byte-range-set of RFC 7233 (a-b, a- and -suffix) against a file of size
+   bytes. Returns the number of satisfiable ranges stored in out, 0 if there
+   are none, -1 if the header is malformed or too long and is to be ignored */
+static int S_ParseRanges( const char *spec, off_t size, byterange_t *out )
 {
-	PB_Declare( rd, MAX_RESP_SIZE );
-	PB_Declare( rf, MAX_RESP_SIZE );
-	char fpath[PATH_MAX] = {};
-	int plen = strlen(path);
-	DIR *dirp;
+	const char *p = spec;
+	int count = 0, parts = 0;
 
-	if(!plen)
+	if( strncmp( p, "bytes=", 6 ))
+		return -1;
+	for( p += 6; *p; )
 	{
-		path = ".";
-		plen = 1;
+		off_t start, end = -1;
+
+		while( *p == ' ' || *p == '\t' )
+			p++;
+		if( *p == '-' )
+		{
+			// suffix: the last bytes of the file
+			if( !( p = S_ParseOff( p + 1, &start )))
+				return -1;
+			if( start > size )
+				start = size;
+			start = size - start;
+			end = size - 1;
+			if( start > end )
+				start = size; // -0 or an empty file: nothing to send
+		}
+		else
+		{
+			if( !( p = S_ParseOff( p, &start )) || *p++ != '-' )
+				return -1;
+			if( *p >= '0' && *p <= '9' )
+			{
+				if( !( p = S_ParseOff( p, &end )) || end < start )
+					return -1;
+			}
+			if( end < 0 || end >= size )
+				end = size - 1; // open ended, or past the end
+		}
+		while( *p == ' ' || *p == '\t' )
+			p++;
+		if( *p && *p++ != ',' )
+			return -1;
+		if( ++parts > RANGE_MAX )
+			return -1;
+		if( start < size )
+		{
+			out[count].start = start;
+			out[count].end = end;
+			count++;
+		}
 	}
+	return parts ? count : -1;
+}
 
-	WriteStringLit(fd, "HTTP/1.1 200 OK\r\n"
-					   "Server: webserver-c\r\n"
-					   "Content-Type: text/html\r\n\r\n<html>"
-					   "<body bgcolor=\"#606060\" text=\"#E0E0E0\" link=\"#F0F0D0\">"
-					   "<table border=\"1\" width=\"100%\"><tr>"
-					   "<td width=\"100%\">/files/");
-	printf("list %s\n", path);
-	dirp = opendir(path);
-	if (!dirp)
+// head of one part of a multipart/byteranges body
+static int S_RangePart( char *out, size_t len, const char *boundary, const char *mime, const byterange_t *r, off_t size )
+{
+	return snprintf( out, len, "\r\n--%s\r\n"
+							   "Content-Type: %s\r\n"
+							   "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+					boundary, mime, (long long)r->start, (long long)r->end, (long long)size );
+}
+
+/* 206 with one range, multipart/byteranges with several. Every part goes out
+   zero-copy, the socket is corked meanwhile so part heads share packets with
+   data. Unsatisfiable ranges get 416, a header to ignore the whole file */
+static void serve_file_range( const char *path, int newsockfd, const char *mime, const char *spec )
+{
+	char resp[MAX_RESP_SIZE], validators[VALIDATORS_SIZE];
+	char boundary[RANGE_BOUNDARY_SIZE], part[512];
+	byterange_t ranges[RANGE_MAX];
+	printbuffer_t pb;
+	off_t left = 0;
+	off_t sent;
+	struct stat sb;
+	int fd, count, i;
+	const int on = 1, off = 0;
+	const char *fname = strrchr(path, '/');
+
+	if( stat( path, &sb ))
+	{
+		SV_NotFound( newsockfd );
+		return;
+	}
+	if( SV_NotModified( newsockfd, &sb ))
+		return;
+	count = S_ParseRanges( spec, sb.st_size, ranges );
+	if( count < 0 )
+	{
+		serve_file( path, newsockfd, mime, 1 );
+		return;
+	}
+	if( !count )
+	{
+		PB_Init( &pb, resp, sizeof( resp ));
+		PB_PrintString( &pb, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+								"Server: webserver-c\r\n"
+								"Content-Range: bytes */%lld\r\n"
+								"Content-Length: 0\r\n\r\n", (long long)sb.st_size );
+		writeall( newsockfd, resp, pb.pos );
+		return;
+	}
+	fd = open( path, O_RDONLY );
+	if( fd < 0 )
+	{
+		SV_NotFound( newsockfd );
+		return;
+	}
+
+	if(!fname) fname = path;
+	else fname++;
+
+	SV_Validators( validators, &sb );
+	PB_Init( &pb, resp, sizeof( resp ));
+	if( count == 1 )
+	{
+		left = ranges[0].end - ranges[0].start + 1;
+		PB_PrintString( &pb, "HTTP/1.1 206 Partial Content\r\n"
+								"Server: webserver-c\r\n"
+								"%s"
+								"Content-Type: %s\r\n"
+								"Content-Range: bytes %lld-%lld/%lld\r\n"
+								"Content-Length: %lld\r\n"
+								"Accept-Ranges: bytes\r\n"
+								"Content-Disposition : inline; filename=\"%s\"\r\n\r\n",
+						validators, mime, (long long)ranges[0].start, (long long)ranges[0].end, (long long)sb.st_size, (long long)left, fname );
+		writeall(newsockfd, resp, pb.pos );
+
+		sent = S_SendFile( newsockfd, fd, ranges[0].start, left );
+		if( sent != left )
+		{
+			if( sent < 0 )
+				perror("webserver (sendfile)");
+			rb->keepalive = 0;
+		}
+		close(fd);
 		return;
+	}
+
+	// the length has to be known up front: part heads are formatted twice
+	snprintf( boundary, sizeof( boundary ), "%08lx%08lx", (unsigned long)time( 0 ), (unsigned long)sb.st_ino );
+	for( i = 0; i < count; i++ )
+		left += S_RangePart( part, sizeof( part ), boundary, mime, &ranges[i], sb.st_size ) + ranges[i].end - ranges[i].start + 1;
+	left += snprintf( part, sizeof( part ), "\r\n--%s--\r\n", boundary );
+	PB_PrintString( &pb, "HTTP/1.1 206 Partial Content\r\n"
+							"Server: webserver-c\r\n"
+							"%s"
+							"Content-Type: multipart/byteranges; boundary=%s\r\n"
+							"Content-Length: %lld\r\n"
+							"Accept-Ranges: bytes\r\n"
+							"Content-Disposition : inline; filename=\"%s\"\r\n\r\n",
+					validators, boundary, (long long)left, fname );
+
+	setsockopt( newsockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof( on ));
+	writeall( newsockfd, resp, pb.pos );
+	for( i = 0; i < count; i++ )
+	{
+		off_t len = ranges[i].end - ranges[i].start + 1;
+		int n = S_RangePart( part, sizeof( part ), boundary, mime, &ranges[i], sb.st_size );
+
+		if( writeall( newsockfd, part, n ) != n || ( sent = S_SendFile( newsockfd, fd, ranges[i].start, len )) != len )
+		{
+			rb->keepalive = 0;
+			break;
+		}
+	}
+	if( i == count )
+	{
+		int n = snprintf( part, sizeof( part ), "\r\n--%s--\r\n", boundary );
+
+		writeall( newsockfd, part, n );
+	}
+	setsockopt( newsockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof( off ));
+	close(fd);
+}
+
+typedef void (*listentry_f)( chunkwriter_t *cw, const char *fpath, const char *name, const struct stat *sb );
+
+/* hidden entries are skipped, directories come first. The directory is read
+   twice instead of keeping the entries, so any size lists in constant memory
+   and goes out in writer sized batches */
+static int SV_ListDir( const char *path, chunkwriter_t *cw, listentry_f entry )
+{
+	dirscan_t d;
+	char fpath[PATH_MAX] = {};
+	int plen = strlen(path);
+	int pass;
+
+	if( !D_OpenAt( &d, AT_FDCWD, path ))
+		return 0;
 	if( plen > PATH_MAX - 2)
 		plen = PATH_MAX - 2;
-	writeall(fd, path, plen);
-	WriteStringLit(fd,"</td><td><a href=\"/index/\">/</a></td></tr>");
-	strncpy(fpath, path, plen);
-	strncpy( post_filepath, path, 1023 );
+	memcpy( fpath, path, plen );
 	fpath[plen++] = '/';
 
-	while (1) {
-		struct dirent *dp;
-		struct stat sb;
+	for( pass = 0; pass < 2; pass++ )
+	{
+		dirscan_ent_t *e;
 
-		dp = readdir(dirp);
-		if (!dp)
-			break;
-		if (dp->d_name[0] == '.')// && !dp->d_name[1])
-			continue;
-		strncpy(&fpath[plen], dp->d_name, PATH_MAX - plen - 1);
-		if (stat(fpath, &sb) != 0)
-			continue;
-		printf("dir %s\n", dp->d_name);
+		if( pass )
+			D_Rewind( &d );
+		while(( e = D_Next( &d )))
+		{
+			struct stat sb;
+			int statted;
 
-		if( S_ISDIR( sb.st_mode ))
-			PB_PrintString( &rd, "<tr><td width=\"100%\"><a href=\"/index/%s\">%s</a></td><td>(dir)</td></tr>", fpath, dp->d_name );
-		else
-			PB_PrintString( &rf, "<tr><td width=\"100%\"><a href=\"/files/%s\" target=\"_blank\">%s</a></td><td>%d</td></tr>", fpath, dp->d_name, (int)sb.st_size );
+			if (e->d_name[0] == '.')
+				continue;
+			// d_type sorts out the other pass without a stat
+			if(( D_Type( &d, e, &sb, &statted ) != DT_DIR ) != pass )
+				continue;
+			if( !statted && D_Stat( &d, e->d_name, &sb ))
+				continue;
+			S_strncpy( &fpath[plen], e->d_name, PATH_MAX - plen );
+			entry( cw, fpath, e->d_name, &sb );
+		}
 	}
+	D_Close( &d );
+	return 1;
+}
 
-	closedir(dirp);
-	writeall(fd, rd_buffer, rd.pos);
-	writeall(fd, rf_buffer, rf.pos);
-	WriteStringLit(fd, "</table></body></html>");
+static void SV_ListEntry( chunkwriter_t *cw, const char *fpath, const char *name, const struct stat *sb )
+{
+	CW_Print( cw, "{\"name\": \"%s\", \"type\": %d, \"size\": %lld},\n", name, !S_ISDIR(sb->st_mode), (long long)sb->st_size );
+}
+
+static void serve_list(const char *path, int fd)
+{
+	chunkwriter_t cw;
+
+	if(!path[0])
+		path = ".";
+
+	// length is not known in advance, the body goes out in chunks
+	CW_Begin(&cw, fd, "HTTP/1.1 200 OK\r\n"
+		"Server: webserver-c\r\n"
+		"Content-Type: text/plain\r\n");
+	CW_WriteLit(&cw, "[\n");
+	printf("list %s\n", path);
+	if( SV_ListDir( path, &cw, SV_ListEntry ))
+		CW_WriteLit(&cw, "{\"name\": \"\", \"type\": -1, \"size\": 0}]");
+	CW_End(&cw);
+}
+
+static void SV_IndexEntry( chunkwriter_t *cw, const char *fpath, const char *name, const struct stat *sb )
+{
+	if( S_ISDIR( sb->st_mode ))
+		CW_Print( cw, "<tr><td width=\"100%%\"><a href=\"/index/%s\">%s</a></td><td>(dir)</td></tr>", fpath, name );
+	else
+		CW_Print( cw, "<tr><td width=\"100%%\"><a href=\"/files/%s\" target=\"_blank\">%s</a></td><td>%lld</td></tr>", fpath, name, (long long)sb->st_size );
+}
+
+static void serve_index(const char *path, int fd)
+{
+	chunkwriter_t cw;
+
+	if(!path[0])
+		path = ".";
+
+	CW_Begin(&cw, fd, "HTTP/1.1 200 OK\r\n"
+					   "Server: webserver-c\r\n"
+					   "Content-Type: text/html\r\n");
+	CW_Print(&cw, "<html>"
+					   "<body bgcolor=\"#606060\" text=\"#E0E0E0\" link=\"#F0F0D0\">"
+					   "<table border=\"1\" width=\"100%%\"><tr>"
+					   "<td width=\"100%%\">/files/%s</td><td><a href=\"/index/\">/</a></td></tr>", path);
+	printf("list %s\n", path);
+	if( SV_ListDir( path, &cw, SV_IndexEntry ))
+		CW_WriteLit(&cw, "</table></body></html>");
+	CW_End(&cw);
 }
 
 static void serve_path_dav(const char *path, int fd);
 
 static void serve_list_dav(const char *path, int fd)
 {
-	char resp[MAX_RESP_SIZE];
+	chunkwriter_t cw;
 	char fpath[PATH_MAX] = {};
 	const char *path2 = path;
 	int plen = strlen(path);
@@ -713,11 +1472,9 @@ static void serve_list_dav(const char *path, int fd)
 		path2 = ".";
 		plen = 1;
 	}
-	//const char resp_list[] =
-			DIR *dirp;
+	dirscan_t d;
 	printf("list %s\n", path2);
-	dirp = opendir(path2);
-	if (!dirp)
+	if( !D_OpenAt( &d, AT_FDCWD, path2 ))
 	{
 		WriteStringLit( fd, "HTTP/1.1 404 Not found\r\n"
 			"Server: webserver-c\r\n"
@@ -745,47 +1502,51 @@ static void serve_list_dav(const char *path, int fd)
 
 	int dirflag = 0;
 	while (1) {
-		struct dirent *dp;
+		dirscan_ent_t *dp;
 		struct stat sb;
+		char etag[ETAG_SIZE], modified[HTTP_DATE_SIZE];
 
-		dp = readdir(dirp);
+		dp = D_Next(&d);
 		if (!dp)
 		{
 			if(!dirflag)
 			{
+				D_Close(&d);
 				serve_path_dav(path, fd);
 				return;
 			}
 			break;
 		}
-		if (dp->d_name[0] == '.' && (dp->d_name[1] == '.' || !dp->d_name[1]))// && !dp->d_name[1])
-			continue;
 		strncpy(&fpath[plen], dp->d_name, PATH_MAX - plen - 1);
-		if (stat(fpath, &sb) != 0)
+		if (D_Stat(&d, dp->d_name, &sb) != 0)
 			continue;
 		if(!dirflag)
 		{
-			WriteStringLit( fd, "HTTP/1.1 207 Multi-Status\r\n"
+			CW_Begin( &cw, fd, "HTTP/1.1 207 Multi-Status\r\n"
 				"Server: webserver-c\r\n"
-				"Content-Type: text/xml\r\n\r\n<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\">" );
+				"Content-Type: text/xml\r\n" );
+			CW_WriteLit( &cw, "<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\">" );
 			{
+				struct stat dsb;
 				PB_Declare( resp1, 1024 );
+				S_HttpDate( modified, fstat( d.fd, &dsb ) ? 0 : dsb.st_mtime );
 				PB_PrintString( &resp1,
 					"<D:response><D:href>/files/%s</D:href><D:propstat><D:prop>"
 					"<D:creationdate>Wed, 30 Oct 2019 18:58:08 GMT</D:creationdate>"
 					"<D:displayname></D:displayname>"
 					//"<D:getetag>\"01572461888\"</D:getetag>"
-					"<D:getlastmodified>Wed, 30 Oct 2019 18:58:08 GMT</D:getlastmodified>"
+					"<D:getlastmodified>%s</D:getlastmodified>"
 					"<D:resourcetype><D:collection/></D:resourcetype>"
 					//"<d:quota-used-bytes>163</d:quota-used-bytes><d:quota-available-bytes>11802275840</d:quota-available-bytes>"
 					"</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>",
-					path2);
+					path2, modified);
 				if( path2[0] && (path2[0] != '.' || path2[1]) )
-					writeall(fd, resp1_buffer, resp1.pos);
+					CW_Write(&cw, resp1_buffer, resp1.pos);
 			}
 			dirflag = 1;
 		}
 		printf("dir %s %s\n", fpath, dp->d_name);
+		S_HttpDate( modified, sb.st_mtime );
 
 		if(S_ISDIR(sb.st_mode))
 		{
@@ -795,33 +1556,35 @@ static void serve_list_dav(const char *path, int fd)
 				"<D:creationdate>Wed, 30 Oct 2019 18:58:08 GMT</D:creationdate>"
 				"<D:displayname>%s</D:displayname>"
 				//"<D:getetag>\"01572461888\"</D:getetag>"
-				"<D:getlastmodified>Wed, 30 Oct 2019 18:58:08 GMT</D:getlastmodified>"
+				"<D:getlastmodified>%s</D:getlastmodified>"
 				"<D:resourcetype><D:collection/></D:resourcetype>"
 				//"<d:quota-used-bytes>163</d:quota-used-bytes><d:quota-available-bytes>11802275840</d:quota-available-bytes>"
 				"</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>",
-				fpath, dp->d_name);
-			writeall(fd, resp1_buffer, resp1.pos);
+				fpath, dp->d_name, modified);
+			CW_Write(&cw, resp1_buffer, resp1.pos);
 		}
 		else if(1)
 		{
 			PB_Declare( resp1, 1024 );
+			S_ETag( etag, &sb );
 			PB_PrintString( &resp1,
 				"<D:response><D:href>/files/%s</D:href><D:propstat><D:prop>"
 				"<D:creationdate>Wed, 30 Oct 2019 18:58:08 GMT</D:creationdate>"
 				"<D:displayname>%s</D:displayname>"
-				"<D:getcontentlength>%d</D:getcontentlength>"
-				//"<D:getetag>\"01572461888\"</D:getetag>"
-				"<D:getlastmodified>Wed, 30 Oct 2019 18:58:08 GMT</D:getlastmodified>"
+				"<D:getcontentlength>%lld</D:getcontentlength>"
+				"<D:getetag>%s</D:getetag>"
+				"<D:getlastmodified>%s</D:getlastmodified>"
 				"<D:resourcetype />"
 				//"<d:getcontenttype>text/plain</d:getcontenttype>"
 				"</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>",
-				fpath, dp->d_name, (int)sb.st_size);
-			writeall(fd, resp1_buffer, resp1.pos);
+				fpath, dp->d_name, (long long)sb.st_size, etag, modified);
+			CW_Write(&cw, resp1_buffer, resp1.pos);
 		}
 
 	}
-	closedir(dirp);
-	WriteStringLit(fd, "</D:multistatus>");
+	D_Close(&d);
+	CW_WriteLit(&cw, "</D:multistatus>");
+	CW_End(&cw);
 }
 
 static void serve_path_dav(const char *path, int fd)
@@ -829,9 +1592,8 @@ static void serve_path_dav(const char *path, int fd)
 	const char *path2 = path;
 	int plen = strlen(path);
 	struct stat sb;
-	PB_DeclareString( resp, MAX_RESP_SIZE, "HTTP/1.1 207 Multi-Status\r\n"
-		"Server: webserver-c\r\n"
-		"Content-Type: application/xml\r\n\r\n<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\">");
+	char etag[ETAG_SIZE], modified[HTTP_DATE_SIZE];
+	PB_DeclareString( resp, MAX_RESP_SIZE, "<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\">");
 
 	if(!plen)
 	{
@@ -851,44 +1613,53 @@ static void serve_path_dav(const char *path, int fd)
 	}*/
 	if(s) // || (!S_ISDIR(sb.st_mode) && sb.st_size == 0))
 	{
-		WriteStringLit( fd, "HTTP/1.1 404 Not found\r\n"
+		SV_ReplyLit( fd, "HTTP/1.1 404 Not found\r\n"
 			"Server: webserver-c\r\n"
-			"Content-Type: application/xml\r\n\r\n<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\" />");
+			"Content-Type: application/xml\r\n",
+			"<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\" />");
 		printf("bad stat %s %d %d %d\n", path, s, errno, sb.st_mode);
 		return;
 
 	}
 
+	S_ETag( etag, &sb );
+	S_HttpDate( modified, sb.st_mtime );
 	PB_PrintString( &resp,
 		"<D:response><D:href>/files/%s</D:href><D:propstat><D:prop>"
 		"<D:creationdate>Wed, 30 Oct 2019 18:58:08 GMT</D:creationdate>"
-		"<D:getcontentlength>%d</D:getcontentlength>"
-		"<D:getetag>\"01572461888\"</D:getetag>"
-		"<D:getlastmodified>Wed, 30 Oct 2019 18:58:08 GMT</D:getlastmodified>"
+		"<D:getcontentlength>%lld</D:getcontentlength>"
+		"<D:getetag>%s</D:getetag>"
+		"<D:getlastmodified>%s</D:getlastmodified>"
 		"%s"
 		"</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response></D:multistatus>",
-		path, (!S_ISDIR(sb.st_mode))?(int)sb.st_size:0,
+		path, (!S_ISDIR(sb.st_mode))?(long long)sb.st_size:0LL, etag, modified,
 		 S_ISDIR(sb.st_mode)?"<D:resourcetype><D:collection/></D:resourcetype>":"<D:resourcetype /><d:getcontenttype>text/plain</d:getcontenttype>");
 	//printf("clen %d\n", (int)(strlen("<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\">") + len_dir));
 	//write(1, resp_dir, len_dir);
-	writeall( fd, resp_buffer, resp.pos );
+	SV_Reply( fd, "HTTP/1.1 207 Multi-Status\r\n"
+		"Server: webserver-c\r\n"
+		"Content-Type: application/xml\r\n", resp_buffer, resp.pos );
 }
 #ifdef ENABLE_SUNZIP
 #include "sunzip/sunzip_integration.h"
 static char sunzip_root[1024];
 static char *sunzip_root_end;
-static size_t sunzip_len, sunzip_pos, sunzip_extralen;
+static off_t sunzip_len, sunzip_pos, sunzip_extralen;
 struct printbuffer_s sunzip_printb;
 static char sunzip_output[4096];
 
 void sunzip_fatal( void )
 {
 	RB_Skip( sunzip_len + sunzip_extralen - sunzip_pos );
-	PB_PrintString( &sunzip_printb, "sunzip: fatal after %d of %d bytes\n", (int)sunzip_pos, (int)sunzip_len );
-	writeall( rbstate.fd, sunzip_output, sunzip_printb.pos );
-	close(rbstate.fd);
+	PB_PrintString( &sunzip_printb, "sunzip: fatal after %lld of %lld bytes\n", (long long)sunzip_pos, (long long)sunzip_len );
+	SV_Reply( rb->fd, "HTTP/1.1 200 OK\r\n"
+		"Server: webserver-c\r\n"
+		"Connection: close\r\n"
+		"Content-type: text/html\r\n", sunzip_output, sunzip_printb.pos );
+	close(rb->fd);
 	puts(sunzip_output);
-	_exit(1);
+	_exit(1); // sunzip can not unwind, zip uploads run in a detached child (CN_Long)
+
 }
 
 int sunzip_read(sunzip_file_in file, void *buffer, size_t size)
@@ -898,21 +1669,31 @@ int sunzip_read(sunzip_file_in file, void *buffer, size_t size)
 		size = sunzip_len - sunzip_pos;
 	if( size == 0 )
 		return 0;
-	printf("read %d\n", size);
+	printf("read %d\n", (int)size);
 	ret = RB_Read(buffer, size);
 	if( ret > 0)
 		sunzip_pos += ret;
 	return ret;
 }
+// stored entries: what is buffered, then socket -> pipe -> file
+long long sunzip_dump(sunzip_file_out file, long long len)
+{
+	off_t ret;
+	if( sunzip_pos + len > sunzip_len )
+		len = sunzip_len - sunzip_pos;
+	ret = RB_Dump( file, len );
+	if( ret > 0 )
+		sunzip_pos += ret;
+	return ret;
+}
 sunzip_file_out sunzip_openout(const char *filename)
 {
 	S_strncpy( sunzip_root_end, filename, &sunzip_root[1023] - sunzip_root_end );
-	create_directories( sunzip_root );
 	printf( "%s\n", sunzip_root );
-	return open( sunzip_root, O_WRONLY | O_CREAT, 0777 );
+	return DC_Create( sunzip_root, O_RDWR | O_CREAT, 0777 ); // dumped entries are read back for their CRC
 }
 #endif
-static void SV_PutZip(int fd, const char *path, int clen )
+static void SV_PutZip(int fd, const char *path, off_t clen )
 {
 #ifdef ENABLE_SUNZIP
 	while(path[0] == '/')path++;
@@ -921,43 +1702,19 @@ static void SV_PutZip(int fd, const char *path, int clen )
 	sunzip_pos = sunzip_extralen = 0;
 	PB_Init( &sunzip_printb, sunzip_output, 4096 );
 
-	PB_WriteStringLit( &sunzip_printb, "HTTP/1.1 200 OK\r\n"
-									  "Server: webserver-c\r\n"
-									  "Content-type: text/html\r\n\r\n"
-									   );
 	sunzip( 0, 1 );
+	// whatever follows the archive end still belongs to this request
+	if( RB_Skip( sunzip_len - sunzip_pos ) != sunzip_len - sunzip_pos )
+		rb->keepalive = 0;
 
-	writeall( fd, sunzip_output, sunzip_printb.pos );
-#endif
-}
-#define htoi(x) (9 * (x >> 6) + (x & 017))
-static unsigned int S_htoi(const char *s) {
-#if 0
-    unsigned int acum = 0;
-    char c;;
-
-    while(((c = *s) >= '0')&&(c <= '9') ||(c >= 'A')&&(c <= 'F')) {
-      if(c > 57) c-= 8;
-      acum = acum << 4;
-      acum = acum + (c - 48);
-      s++;
-    }
-    return acum;
+	SV_Reply( fd, "HTTP/1.1 200 OK\r\n"
+				  "Server: webserver-c\r\n"
+				  "Content-type: text/html\r\n", sunzip_output, sunzip_printb.pos );
 #else
-	unsigned int acum = 0;
-
-	while(*s >= '0')
-	{
-		acum <<= 4;
-		acum += htoi(*s);
-		s++;
-	}
-	return acum;
+	rb->keepalive = 0;
 #endif
 }
-
-
-static void SV_Put(int newsockfd, const char *uri, int clen )
+static void SV_Put(int newsockfd, const char *uri, off_t clen )
 {
 	PB_DeclareString(resp_ok, 1024,"HTTP/1.1 201 Created\r\n"
 									"Server: webserver-c\r\n"
@@ -970,149 +1727,389 @@ static void SV_Put(int newsockfd, const char *uri, int clen )
 		return;
 	}
 	if(strncmp(path, "/files/", 7) || strstr(path, ".."))
-#ifdef ENABLE_FORK
-		_exit(1);
-#else
+	{
+		rb->keepalive = 0;
 		return;
-#endif
+	}
 
 	path += 7;
 	while(path[0] == '/')path++;
-	create_directories(path);
-	fd = open(path, O_CREAT | O_WRONLY, 0666);
-	int ret = RB_Dump( fd, clen );
+	fd = DC_Create(path, O_CREAT | O_WRONLY, 0666);
+	if( fd < 0 )
+	{
+		SV_WriteFailed( newsockfd, S_NoSpace( fd ));
+		return;
+	}
+	off_t ret = RB_Dump( fd, clen );
+	int nospace = S_NoSpace( ret );
+	if( ret != clen )
+		rb->keepalive = 0;
 	printf("done %s\n", path);
 	if(ret > 0)
 		ftruncate(fd,ret);
 	close(fd);
 
-	if( ret >= 0)
+	if( ret < 0 )
+		SV_WriteFailed( newsockfd, nospace );
+	else
 	{
 		PB_WriteString( &resp_ok, path );
-		PB_WriteStringLit( &resp_ok, "\r\nContent-type: text/html\r\n\r\n"
-						  "OK");
-		writeall( newsockfd, resp_ok_buffer, resp_ok.pos );
+		PB_WriteStringLit( &resp_ok, "\r\nContent-type: text/html\r\n" );
+		SV_ReplyLit( newsockfd, resp_ok_buffer, "OK" );
 	}
 }
 
-static void SV_PutChunked( int newsockfd, const char *uri, int explen )
+enum
 {
-	PB_DeclareString(resp_ok, 1024,"HTTP/1.1 201 Created\r\n"
-									"Server: webserver-c\r\n"
-									"Location: /files/");
-	int fd;
-	const char *path = uri;
-	char chunkstr[16];
-	unsigned int chunklen;
-	size_t filelen = 0;
+	CK_SIZE,    // chunk-size line, extensions after ';' are ignored
+	CK_DATA,    // chunk content
+	CK_DATAEND, // line break closing the content
+	CK_TRAILER, // trailer fields up to the empty line
+	CK_DONE,
+	CK_BAD
+};
+
+#define CK_SIZE_MAX ( (off_t)1 << 58 ) // one more hex digit would overflow off_t
+
+// size from a chunk-size line without its line feed, -1 if malformed
+static off_t S_ChunkSize( const char *p, const char *end )
+{
+	const char *digits = p;
+	off_t acum = 0;
 
-	if(strncmp(path, "/files/", 7) || strstr(path, ".."))
-		_exit(1);
+	for( ; p < end; p++ )
+	{
+		int c = *p | 0x20, d;
 
-	path += 7;
+		if( *p >= '0' && *p <= '9' )
+			d = *p - '0';
+		else if( c >= 'a' && c <= 'f' )
+			d = c - 'a' + 10;
+		else
+			break;
+		if( acum >= CK_SIZE_MAX )
+			return -1;
+		acum = acum << 4 | d;
+	}
+	if( p == digits )
+		return -1;
+	while( p < end && ( *p == ' ' || *p == '\t' ))
+		p++;
+	if( p < end && *p != ';' && ( *p != '\r' || p + 1 != end ))
+		return -1;
+	return acum;
+}
+
+// content into the file, after a failed write the rest is dropped
+static void CK_Write( int fd, const char *data, size_t len, int *failed )
+{
+	int res;
+
+	if( *failed || !len )
+		return;
+	res = writeall( fd, data, len );
+	if( res < 0 )
+		*failed = S_NoSpace( res ) ? 2 : 1;
+}
+
+/* chunked body decoded while it arrives: one read usually holds many small
+   chunks, their content is gathered and written in one go. Chunks larger
+   than the buffer are spliced into the file like a Content-Length body.
+   Bytes after the last chunk stay buffered for the next request */
+static void SV_PutChunked( int newsockfd, const char *uri )
+{
+	static char stage[BUFFER_SIZE];
+	PB_DeclareString(resp_ok, 1024,"HTTP/1.1 201 Created\r\n"
+									"Server: webserver-c\r\n"
+									"Location: /files/");
+	int fd;
+	const char *path = uri;
+	size_t staged = 0;
+	off_t chunklen = 0;
+	off_t filelen = 0;
+	int state = CK_SIZE;
+	int failed = 0; // 1 when the file could not be written, 2 when the disk is full
+
+	if(strncmp(path, "/files/", 7) || strstr(path, ".."))
+	{
+		rb->keepalive = 0;
+		return;
+	}
+
+	path += 7;
 	while(path[0] == '/')path++;
-	create_directories(path);
-	fd = open(path, O_CREAT | O_WRONLY, 0666);
-	do
+	fd = DC_Create(path, O_CREAT | O_WRONLY, 0666);
+	if( fd < 0 )
 	{
-		int ret;
-		if( RB_ReadLine( chunkstr, 15 ) <= 0 )
-			break;
-		printf("chunk hex %s\n", chunkstr);
+		SV_WriteFailed( newsockfd, S_NoSpace( fd ));
+		return;
+	}
+	// the uri lives in the request head, which the first compaction overwrites
+	PB_WriteString( &resp_ok, path );
+	PB_WriteStringLit( &resp_ok, "\r\nContent-type: text/html\r\n" );
+	while( state < CK_DONE && !failed )
+	{
+		const char *data = &rb->read_buffer[rb->read_offset];
+		size_t avail = rb->ahead_offset - rb->read_offset, used = 0;
+		const char *eol = NULL;
+		int wait = 0;
 
-		chunklen = S_htoi( chunkstr );
+		if( state == CK_DATA )
+		{
+			used = avail < chunklen ? avail : chunklen;
+			if( staged + used > sizeof( stage ))
+			{
+				CK_Write( fd, stage, staged, &failed );
+				staged = 0;
+			}
+			if( used >= sizeof( stage ))
+				CK_Write( fd, data, used, &failed );
+			else
+			{
+				memcpy( stage + staged, data, used );
+				staged += used;
+			}
+			rb->read_offset += used;
+			chunklen -= used;
+			filelen += used;
+			if( !chunklen )
+				state = CK_DATAEND;
+			else if( chunklen >= READ_BUFFER_SIZE )
+			{
+				// the buffer is drained, the rest of a big chunk skips it
+				off_t ret;
+
+				CK_Write( fd, stage, staged, &failed );
+				staged = 0;
+				if( failed )
+					break;
+				ret = RB_Dump( fd, chunklen );
+				if( ret != chunklen )
+				{
+					if( ret < 0 )
+						failed = S_NoSpace( ret ) ? 2 : 1;
+					break;
+				}
+				filelen += ret;
+				state = CK_DATAEND;
+			}
+			else
+				wait = 1;
+		}
+		else if(( eol = S_FindByte( data, data + avail, '\n' )))
+		{
+			// content ends with its own line break, a trailer section with an empty line
+			int empty = eol == data || ( eol == data + 1 && data[0] == '\r' );
 
-		printf("chunk len %d\n", chunklen);
-		if(!chunklen)
-			break;
+			if( state == CK_SIZE )
+			{
+				chunklen = S_ChunkSize( data, eol );
+				state = chunklen < 0 ? CK_BAD : chunklen ? CK_DATA : CK_TRAILER;
+			}
+			else if( state == CK_DATAEND )
+				state = empty ? CK_SIZE : CK_BAD;
+			else if( empty )
+				state = CK_DONE;
+			rb->read_offset += eol - data + 1;
+		}
+		else
+			wait = 1;
 
-		ret = RB_Dump( fd, chunklen );
-		if( ret < 0)
+		// a line longer than the whole buffer is refused as well
+		if( wait && !RB_FillBody( avail + READ_BUFFER_SIZE ))
 			break;
-		filelen += ret;
-		if( explen && filelen == explen )
-			break;
-		RB_SkipLine();
-		//RB_Dump(1, 2);
-
+	}
+	CK_Write( fd, stage, staged, &failed );
 
-	}while(1);
+	ftruncate( fd, filelen );
+	close( fd );
 
-	printf( "done %s %d\n", path, (int)filelen );
+	if( failed )
+	{
+		SV_WriteFailed( newsockfd, failed == 2 );
+		return;
+	}
+	if( state != CK_DONE )
+	{
+		rb->keepalive = 0;
+		SV_ReplyLit( newsockfd, "HTTP/1.1 400 Bad Request\r\n"
+								"Server: webserver-c\r\n"
+								"Connection: close\r\n"
+								"Content-type: text/html\r\n",
+								"Bad chunked body" );
+		return;
+	}
+	SV_ReplyLit( newsockfd, resp_ok_buffer, "OK" );
+}
 
-	if(filelen > 0)
-		ftruncate(fd,filelen);
-	close(fd);
+#define MP_BOUNDARY_LEN 70 // RFC 2046 limit
 
-	PB_WriteString( &resp_ok, path );
-	PB_WriteStringLit( &resp_ok, "\r\nContent-type: text/html\r\n\r\n"
-					  "OK");
-	writeall( newsockfd, resp_ok_buffer, resp_ok.pos );
+enum
+{
+	MP_PREAMBLE, // anything before the first boundary
+	MP_DELIM,    // after a boundary: CRLF starts a part, "--" ends the body
+	MP_HEADERS,  // part headers up to the empty line
+	MP_DATA,     // part content up to the next CRLF--boundary
+	MP_DONE
+};
+
+// relative path from a part's Content-Disposition filename, NULL for form fields
+static const char *SV_PartFilename( const char *headers, const char *end, char *out, size_t outlen )
+{
+	const char *name = S_FindString( headers, end, "filename=\"", sizeof( "filename=\"" ) - 1 );
+	const char *quote;
+
+	if( !name )
+		return NULL;
+	name += sizeof( "filename=\"" ) - 1;
+	quote = S_FindByte( name, end, '"' );
+	if( !quote || quote == name || quote - name >= outlen )
+		return NULL;
+	memcpy( out, name, quote - name );
+	out[quote - name] = 0;
+	if( strstr( out, ".." ))
+		return NULL;
+	// old browsers send the full client path
+	if(( name = strrchr( out, '\\' )))
+		out = (char *)name + 1;
+	while( *out == '/' )
+		out++;
+	return *out ? out : NULL;
 }
 
-static void SV_PostUpload(int fd, const char *uri, int clen, const char *boundary, int boundary_len )
+/* multipart/form-data parsed while it arrives, every file part goes to its
+   own file under the directory that follows the first segment of the uri,
+   POST /legacyupload/<dir>, so one POST can carry a folder. Other form fields
+   are dropped */
+static void SV_PostUpload(int fd, const char *uri, off_t clen, const char *boundary, int boundary_len )
 {
-	char line[1024];
-	char filename[1024] = "upload_file";
-	PB_Declare( filepath, 1024);
-	int skiplen = 0, dumpfd;
-	PB_WriteString( &filepath, post_filepath );
-	PB_WriteStringLit( &filepath, "/" );
-	if( !post_filepath[0] )
+	char delim[MP_BOUNDARY_LEN + 4] = "\r\n--";
+	size_t dlen = boundary_len + 4;
+	off_t left = clen;
+	int state = MP_PREAMBLE, outfd = -1;
+	int failed = 0; // as in SV_PutChunked
+	char filename[PATH_MAX];
+	PB_Declare( filepath, PATH_MAX );
+	size_t dirlen;
+
+	while( *uri == '/' ) uri++;
+	while( *uri && *uri != '/' ) uri++;
+	while( *uri == '/' ) uri++;
+	if( strstr( uri, ".." ) || boundary_len <= 0 || boundary_len > MP_BOUNDARY_LEN )
+	{
+		rb->keepalive = 0;
 		return;
+	}
+	// the uri and the boundary live in the request head, which the first compaction overwrites
+	PB_WriteString( &filepath, *uri ? uri : "." );
+	while( filepath.pos > 1 && filepath_buffer[filepath.pos - 1] == '/' )
+		filepath.pos--;
+	PB_WriteStringLit( &filepath, "/" );
+	dirlen = filepath.pos;
+	memcpy( delim + 4, boundary, boundary_len );
 
-	while( line[0] != '\r' )
+	while( state != MP_DONE )
 	{
-		skiplen += RB_ReadLine(line, 1024) + 2;
-		if(!strncasecmp( line, "Content-Disposition: form-data; name=\"file\"; filename=\"", sizeof("Content-Disposition: form-data; name=\"file\"; filename=")))
+		const char *data = &rb->read_buffer[rb->read_offset];
+		size_t avail = rb->ahead_offset - rb->read_offset, used = 0;
+		const char *hit = NULL;
+
+		if( avail > left )
+			avail = left;
+
+		switch( state )
 		{
-			char *end;
+		case MP_PREAMBLE:
+			// the first boundary may open the body, so it is searched without the CRLF
+			hit = S_FindString( data, data + avail, delim + 2, dlen - 2 );
+			if( hit )
+			{
+				used = hit - data + dlen - 2;
+				state = MP_DELIM;
+			}
+			else if( avail >= dlen )
+				used = avail - dlen + 1;
+			break;
+		case MP_DELIM:
+			if( avail >= 2 && data[0] == '-' && data[1] == '-' )
+			{
+				used = 2;
+				state = MP_DONE;
+			}
+			else if(( hit = S_FindByte( data, data + avail, '\n' )))
+			{
+				used = hit - data + 1;
+				state = MP_HEADERS;
+			}
+			break;
+		case MP_HEADERS:
+			if( avail >= 2 && data[0] == '\r' && data[1] == '\n' )
+				hit = data - 2;
+			else
+				hit = S_FindString( data, data + avail, "\r\n\r\n", 4 );
+			if( hit )
+			{
+				const char *name = SV_PartFilename( data, hit, filename, sizeof( filename ));
 
-			if( !strstr( line, ".." ))
-			strcpy(filename, &line[0] + sizeof( "Content-Disposition: form-data; name=\"file\"; filename=" ));
-			if(( end = strchr(filename, '\"')))
-				*end = 0;
-			printf("filename %s\n", filename);
+				used = hit - data + 4;
+				state = MP_DATA;
+				if( name )
+				{
+					filepath.pos = dirlen;
+					PB_WriteString( &filepath, name );
+					outfd = DC_Create( filepath_buffer, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+					if( outfd < 0 )
+						failed = S_NoSpace( outfd ) ? 2 : 1;
+				}
+			}
+			break;
+		case MP_DATA:
+			// content goes out as it comes, only a possible partial delimiter is kept back
+			hit = S_FindString( data, data + avail, delim, dlen );
+			used = hit ? hit - data : avail >= dlen ? avail - dlen + 1 : 0;
+			if( outfd >= 0 )
+				CK_Write( outfd, data, used, &failed );
+			if( hit )
+			{
+				used += dlen;
+				if( outfd >= 0 )
+					close( outfd );
+				outfd = -1;
+				state = MP_DELIM;
+			}
+			break;
 		}
-		puts(line);
+
+		rb->read_offset += used;
+		left -= used;
+		if( failed )
+			break;
+		if( !used && state != MP_DONE && !RB_FillBody( left ))
+			break; // truncated body or a part head larger than the buffer
 	}
-	PB_WriteString( &filepath, filename );
-	puts( filepath_buffer );
-#if 0
-	if( !strcmp( uri, "/legacyzip" ))
+	if( outfd >= 0 )
+		close( outfd );
+	if( failed )
 	{
-		sunzip_root_end = &sunzip_root[S_strncpy( sunzip_root, post_filepath, 1023 )];
-		*sunzip_root_end++ = '/';
-		sunzip_len = clen - skiplen - boundary_len ;
-		sunzip_pos = 0;
-		sunzip_extralen = boundary_len + 8;
-		PB_Init( &sunzip_printb, sunzip_output, 4096 );
-
-		PB_WriteStringLit( &sunzip_printb, "HTTP/1.1 200 OK\r\n"
-										  "Server: webserver-c\r\n"
-										  "Content-type: text/html\r\n\r\n"
-						  );
-		sunzip( 0, 1 );
-		RB_Skip( boundary_len + 8 );
-		printf("done\n");
-
-		writeall( fd, sunzip_output, sunzip_printb.pos );
+		SV_WriteFailed( fd, failed == 2 );
+		return;
 	}
-	else
-#endif
+
+	// epilogue after the closing boundary
+	if( state != MP_DONE || RB_Skip( left ) != left )
 	{
-		dumpfd = open( filepath_buffer, O_WRONLY | O_CREAT, 0755 );
-		//write(1, "beg\n", 4);
-		RB_Dump( dumpfd, clen - skiplen - boundary_len );
-		//write(1, "end\n", 4);
-		close( dumpfd );
-		RB_Dump( 1, boundary_len + 8 );
-		//RB_SkipLine();
-		WriteStringLit( fd, "HTTP/1.1 200 OK\r\n"
-								  "Server: webserver-c\r\n"
-								  "Content-type: text/html\r\n\r\n"
-								  "OK" );
+		rb->keepalive = 0;
+		SV_ReplyLit( fd, "HTTP/1.1 400 Bad Request\r\n"
+						 "Server: webserver-c\r\n"
+						 "Connection: close\r\n"
+						 "Content-type: text/html\r\n",
+						 "Bad multipart body" );
+		return;
 	}
+	SV_ReplyLit( fd, "HTTP/1.1 200 OK\r\n"
+					 "Server: webserver-c\r\n"
+					 "Content-type: text/html\r\n",
+					 "OK" );
 }
 
 #include "zipflow/zipflow.h"
@@ -1169,503 +2166,839 @@ void SV_ZipFlow( ZIP *zip, const char *path, int fd )
 }
 #endif
 
-static int zflow_write(void *fd, const void *ptr, size_t len)
+static int zflow_write(void *cw, const void *ptr, size_t len)
 {
-//	return writeall((int)fd,ptr,len) != len;
-	return writeall(*(int*)fd,ptr,len) != len;
+	return !CW_Write( cw, ptr, len );
 }
 
-int main(int argc, char **argv, char **envp) {
-	char buffer[BUFFER_SIZE] = { };
-	int sockfd;
-	unsigned short port = PORT;
+#ifndef ZIP_PRECRC
+#define ZIP_PRECRC 1 // stored zip entries get their CRC-32 up front, no data descriptor
+#endif
 
-	//printf("%d %p %p\n", argc, argv, envp);
-	if(argc == 3)
-	{
-		chdir(argv[1]);
-		port = atoi(argv[2]);
-	}
+// CRC-32 of stored zip entries from the checksum cache, computed there on a miss
+static int zflow_crc(void *cw, int fd, uint64_t len, uint32_t *crc)
+{
+#if defined(ENABLE_ZLIB) && defined(ENABLE_LIBC)
+	struct stat sb;
 
-	// Create a socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd == -1) {
-		perror("webserver (socket)");
-		return 1;
-	}
-	post_filepath[0] = '.';
-	printf("socket created successfully\n");
-	const int enable = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
-		perror("setsockopt(SO_REUSEADDR) failed");
-	// Create the address to bind the socket to
-	struct sockaddr_in host_addr;
-	int host_addrlen = sizeof(host_addr);
+	return fstat( fd, &sb ) || sb.st_size != len || !HC_Sum( fd, &sb, crc );
+#else
+	return 1;
+#endif
+}
 
-	host_addr.sin_family = AF_INET;
-	host_addr.sin_port = htons(port);
-	host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+// stored zip entries skip the chunk buffer
+static int zflow_send(void *cw, int fd, int64_t off, size_t len)
+{
+	return !CW_SendFile( cw, fd, off, len );
+}
+
+#define MAX_CONNECTIONS 1024
+#define MAX_EVENTS 64
+#ifndef WORKERS
+#define WORKERS 4 // pre-forked processes sharing the listening socket
+#endif
+#define DETACH_BODY 65536 // upload bytes still to come from which a child takes the connection
+#define DETACH_FILE ( 1024 * 1024 ) // downloads from this size are sent by a child
+#define DETACH_MAX 32 // live children per worker, past that long requests are served in the worker
+#define HEADER_TIMEOUT 30 // s, request head and small bodies must arrive in this time
+#define KEEPALIVE_TIMEOUT 15 // s, idle persistent connections are closed after this
+
+static conn_t connections[MAX_CONNECTIONS];
+static conn_t *conn_free[MAX_CONNECTIONS];
+static int conn_free_count;
+static int listenfd = -1, epollfd = -1;
+static int detached; // this process is a child serving one handed off connection
+static int children; // detached children of this worker not reaped yet
+
+static long S_Now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec;
+}
+
+static void SV_Request( void )
+{
+	static char buffer[BUFFER_SIZE];
+	request_t *rq = &rb->req;
+	int newsockfd = rb->fd;
+	char *uri = rq->uri;
+	const char *value;
 
 	// Create client address
 	struct sockaddr_in client_addr;
 	int client_addrlen = sizeof(client_addr);
 
-	// Bind the socket to the address
-	if (bind(sockfd, (struct sockaddr *)&host_addr, host_addrlen) != 0) {
-		perror("webserver (bind)");
-		return 1;
+	// Get client address
+	int sockn = getsockname(newsockfd, (struct sockaddr *)&client_addr,
+							(socklen_t *)&client_addrlen);
+	rb->keepalive = 0;
+	if (sockn < 0) {
+		perror("webserver (getsockname)");
+		return;
 	}
-	printf("socket successfully bound to address\n");
 
-	// Listen for incoming connections
-	if (listen(sockfd, SOMAXCONN) != 0) {
-		perror("webserver (listen)");
-		return 1;
+	// the head is already parsed and indexed by the event loop
+	rb->keepalive = rq->http11;
+	if(( value = RQ_Header( rq, "connection" )) && strcasestr( value, "close" ))
+		rb->keepalive = 0;
+	int chunked = ( value = RQ_Header( rq, "transfer-encoding" )) && strcasestr( value, "chunked" );
+	// only uploads know how to walk a chunked body
+	if( rq->method != M_PUT && chunked )
+		rb->keepalive = 0;
+
+	off_t clen = 0;
+	if(( value = RQ_Header( rq, "content-length" )))
+	{
+		Report("content-length %s\n", value);
+		clen = S_atoll( value );
 	}
-	printf("server listening for connections: http://localhost:%d\n",PORT);
 
-	for (;;) {
-		// Accept incoming connections
-		int newsockfd = accept(sockfd, (struct sockaddr *)&host_addr,
-							   (socklen_t *)&host_addrlen);
-		if (newsockfd < 0) {
-			perror("webserver (accept)");
-			continue;
-		}
-		printf("connection accepted\n");
+	printf("[%s:%u] %s %s\n", inet_ntoa(client_addr.sin_addr),
+		   ntohs(client_addr.sin_port), rq_methods[rq->method], uri);
 
-		// Get client address
-		int sockn = getsockname(newsockfd, (struct sockaddr *)&client_addr,
-								(socklen_t *)&client_addrlen);
-		if (sockn < 0) {
-			perror("webserver (getsockname)");
-			close(newsockfd);
-			continue;
-		}
 
-		// Read the request
-		char method[METHOD_LEN] = "", uri[URI_LEN] = "";
-		RB_Init(newsockfd);
-		if( RB_ReadHeaders( method, uri, buffer, sizeof( buffer ) - 1) < 0 )
+	if( rq->method == M_PUT )
+	{
+		if( clen > 0 )
+			SV_Put( newsockfd, uri, clen );
+		else
 		{
-			close( newsockfd );
-			continue;
+			// Apple like to send some chunks
+			if( chunked )
+				SV_PutChunked( newsockfd, uri );
+			else
+				SV_Put( newsockfd, uri, 0 );
 		}
+	}
+	else if( rq->method == M_POST )
+	{
+		const char *boundary = RQ_Header( rq, "content-type" );
+		if( boundary && !strncasecmp( boundary, "multipart/form-data", sizeof( "multipart/form-data" ) - 1 )
+			&& ( boundary = strstr( boundary, "boundary=" )))
+		{
+			int boundary_len = 0;
 
-		const char *contentlength = strcasestr(buffer, "content-length: ");
-		int clen = 0;
-		if(contentlength)
+			boundary += sizeof( "boundary=" ) - 1;
+			if( *boundary == '"' )
+			{
+				boundary++;
+				while( boundary[boundary_len] && boundary[boundary_len] != '"' )
+					boundary_len++;
+			}
+			else
+				while( boundary[boundary_len] && boundary[boundary_len] != ';' && boundary[boundary_len] != ' ' )
+					boundary_len++;
+			SV_PostUpload( newsockfd, uri, clen, boundary, boundary_len );
+		}
+		else
+			rb->keepalive = 0;
+	}
+	else if( rq->method == M_DELETE )
+	{
+		char *path = uri;
+		RB_Skip( clen );
+		if(strncmp(path, "/files/", 7) || strstr(path, ".."))
 		{
-			Report("content-length %s\n", contentlength);
-			clen = atoi(contentlength + sizeof("content-length: ") - 1);
+			rb->keepalive = 0;
+			return;
 		}
+		path += 7;
+		unlink(path);
+		DC_Forget();
+		SV_ReplyLit(newsockfd, "HTTP/1.1 200 OK\r\n"
+							   "Server: webserver-c\r\n"
+							   "Content-type: text/html\r\n",
+					"OK");
+	}
+	else if( rq->method == M_GET )
+	{
+		char *path = uri;
+		RB_Skip( clen );
+		if(strstr(path, ".."))
+		{
+			rb->keepalive = 0;
+			return;
+		}
+		if(!strncmp(path, "/list/", 6))
+		{
+			path += 6;
+			serve_list(path, newsockfd);
+		}
+		else if(!strncmp(path, "/zip/", 5))
+		{
+#ifdef ENABLE_ZIPFLOW
+			static chunkwriter_t cw;
+			ZIP *zip = zip_pipe( (void*)&cw, zflow_write, 1 );
+			zip_sendfile( zip, zflow_send );
+			zip_crc( zip, ZIP_PRECRC, zflow_crc );
+			char *p;
+			path += 5;
+			p = strrchr( path, '.' );
+			if(p)*p = 0;
+
+			CW_Begin( &cw, newsockfd, "HTTP/1.1 200 OK\r\n"
+							   "Server: webserver-c\r\n"
+							   "Content-Type: application/x-zip-compressed\r\n"
+							   "Content-Disposition : attachment; filename=\"folder.zip\"\r\n" );
+
+			//SV_ZipFlow( zip, path, newsockfd );
+			zip_entry( zip, path );
+			zip_close( zip );
+			CW_End( &cw );
+#endif
+		}
+		else if(!strcmp(path, "/indexredir"))
+		{
+			SV_ReplyLit(newsockfd, "HTTP/1.1 200 OK\r\n"
+								   "Server: webserver-c\r\n"
+								   "Content-type: text/html\r\n",
+								   "<html><body bgcolor=\"#000000\" link=\"#F0F0D0\"><a href=\"/index/\">list files</a></body></html>");
+		}
+		else if(!strncmp(path, "/index/", 7))
+		{
+			path += 7;
+			serve_index(path, newsockfd);
+		}
+		else if(strncmp(path, "/files/", 7))
+		{
+#ifdef ENABLE_PAGE
+			SV_ReplyLit(newsockfd, "HTTP/1.1 200 OK\r\n"
+								   "Server: webserver-c\r\n"
+								   "Content-type: text/html\r\n",
+								   page_content);
+#else
+			serve_file("folderupload.html", newsockfd, "text/html", 1);
+#endif
+		}
+		else
+		{
+			const char *rng = RQ_Header( rq, "range" );
+			path += 7;
+			if( rng )
+				serve_file_range( path, newsockfd, "application/octet-stream", rng );
+			else
+				serve_file(path, newsockfd, "application/octet-stream", 1);
+		}
+	}
+	else if( rq->method == M_HEAD )
+	{
+		char *path = uri;
 
-		printf("[%s:%u] %s %s\n", inet_ntoa(client_addr.sin_addr),
-			   ntohs(client_addr.sin_port), method, uri);
+		//usleep(15000);
 
+		RB_Dump( 1, clen );
 
-		if(!strcmp(method,"PUT"))
+		if(strncmp(path, "/files/", 7) || strstr(path, ".."))
 		{
-			int r = 0;
-#ifdef ENABLE_FORK
-			r = fork();
-#endif
-			if(r == 0) // child, copy the file
+			rb->keepalive = 0;
+			return;
+		}
+		path += 7;
+		struct stat sb;
+			if(!stat(path,&sb))
 			{
-				puts( buffer );
-				if( clen > 0 )
-					SV_Put( newsockfd, uri, clen );
-				else
-				{
-					// Apple like to send some chunks
-					if( strcasestr( buffer, "transfer-encoding: chunked" ))
-					{
-						int explen = 0;
-						char *el = strcasestr( buffer, "x-expected-entity-length: " );
-						if(el)
-							explen = atoi( el + sizeof( "x-expected-entity-length:" ));
-						SV_PutChunked( newsockfd, uri, explen );
-					}
-					else
-						SV_Put( newsockfd, uri, 0 );
-				}
-				close(newsockfd);
-#ifdef ENABLE_FORK
-				_exit(0);
-#endif
+				const char *fname = strrchr(path, '/');
+				char validators[VALIDATORS_SIZE];
+				printbuffer_t resp;
+				if(!fname) fname = path;
+				else fname++;
+
+				if( SV_NotModified( newsockfd, &sb ))
+					return;
+				SV_Validators( validators, &sb );
+				PB_Init( &resp, buffer, sizeof( buffer ) - 1);
+				PB_PrintString( &resp,
+							   "HTTP/1.1 200 OK\r\n"
+							   "Server: webserver-c\r\n"
+							   "%s"
+							   "Content-Type: %s\r\n"
+							   "Content-Length: %lld\r\n"
+							   "Accept-Ranges: bytes\r\n"
+							   "Content-Disposition : inline; filename=\"%s\"\r\n\r\n", validators, "text/plain", (long long)sb.st_size, fname );
+				writeall( newsockfd, buffer, resp.pos );
+				printf("HEAD %s %s %lld\n", path, fname, (long long)sb.st_size);
 			}
 			else
+				WriteStringLit(newsockfd, "HTTP/1.1 404 Not found\r\n"
+										  "Server: webserver-c\r\n"
+										  "Content-Length:0\r\n"
+										  "\r\n");
+	}
+	else if( rq->method == M_MKCOL )
+	{
+		char *path = uri;
+		if(strncmp(path, "/files/", 7) || strstr(path, ".."))
+		{
+			rb->keepalive = 0;
+			return;
+		}
+		path += 7;
+		DC_MakeParents(path);
+		mkdir(path, 0777);
+		//usleep(10000);
+
+		RB_Dump(1, clen);
+		WriteStringLit(newsockfd,"HTTP/1.1 201 Created\r\n"
+								  "Server: webserver-c\r\n"
+								  "Content-Length: 0\r\n\r\n" )
+	}
+	else if( rq->method == M_PROPPATCH )
+	{
+		char *path = uri;
+		PB_DeclareString( resp_ok, 1024, "<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\"><D:response><D:href>" );
+		if(strncmp(path, "/files/", 7) || strstr(path, ".."))
+		{
+			rb->keepalive = 0;
+			return;
+		}
+		RB_Dump(1, clen);
+		PB_WriteString( &resp_ok, uri );
+		PB_WriteStringLit( &resp_ok, "</D:href><D:propstat><D:prop></D:prop><D:status>HTTP/1.1 403 Forbidden</D:status></D:propstat></D:response></D:multistatus>");
+		SV_Reply(newsockfd, "HTTP/1.1 207 Multi-Status\r\n"
+							"Server: webserver-c\r\n"
+							"Content-type: application/xml\r\n", resp_ok_buffer, resp_ok.pos );
+	}
+	else if( rq->method == M_MOVE )
+	{
+		char *path = uri;
+		const char *dest;
+		if(strncmp(path, "/files/", 7) || strstr(path, ".."))
+		{
+			rb->keepalive = 0;
+			return;
+		}
+		path += 7;
+
+		RB_Dump(1, clen);
+		dest = RQ_Header( rq, "destination" );
+		if(dest)
+		{
+			printf("move %s %s\n", path, dest);
+			if(!strncmp(dest, "/files/", 7) && !strstr(dest, ".."))
 			{
-				close(newsockfd);
-				if(r < 0)
-				{
-					perror("fork");
-					close(sockfd);
-					return 1;
-				}
+				dest += 7;
+				rename(path, dest);
+				DC_Forget();
 			}
 		}
-		else if(!strcmp(method,"POST"))
+
+		SV_ReplyLit(newsockfd, "HTTP/1.1 201 Created\r\n"
+							   "Server: webserver-c\r\n"
+							   "Content-type: text/html\r\n",
+							   "OK");
+	}
+	else if( rq->method == M_PROPFIND )
+	{
+		char *path = uri;
+		const char resp_auth[] = "HTTP/1.1 401 Unauthorized\r\n"
+							   "Server: webserver-c\r\n"
+							   "WWW-Authenticate: Basic realm=\"User Visible Realm\"\r\n\r\n";
+		RB_Dump(1, clen);
+		/*if(!strcasestr(buffer, "authorization: "))
 		{
-			int r = 0;
-#ifdef ENABLE_FORK
-			r = fork();
+			writeall(newsockfd, resp_auth, sizeof(resp_auth) - 1);
+			return;
+		}*/
+		if(path[0]=='/' && path[1] == '\0')
+		{
+		   path="/files";
+		}
+		if(strncmp(path, "/files", 6) || strstr(path, ".."))
+		{
+			serve_path_dav("", newsockfd);
+			return;
+		}
+		path += 7;
+		if(( value = RQ_Header( rq, "depth" )) && !strcmp( value, "0" ))
+		{
+			serve_path_dav(path, newsockfd);
+		}
+		else
+		{
+			serve_list_dav(path, newsockfd);
+		}
+	}
+	else if( rq->method == M_OPTIONS )
+	{
+		/*"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain\r\n"
+		"Access-Control-Allow-Methods: PROPFIND, PROPPATCH, COPY, MOVE, DELETE, MKCOL, PUT, UNLOCK, GETLIB, VERSION-CONTROL, CHECKIN, CHECKOUT, UNCHECKOUT, REPORT, UPDATE, CANCELUPLOAD, HEAD, OPTIONS, GET, POST\r\n"
+		"Access-Control-Allow-Headers: Overwrite, Destination, Content-Type, Depth, User-Agent, X-File-Size, X-Requested-With, If-Modified-Since, X-File-Name, Cache-Control\r\n"
+		"Access-Control-Max-Age: 86400\r\n\r\n";*/
+		//if( valread >= 0)
+		RB_Dump(1, clen);
+		WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\nAllow: GET,HEAD,PUT,OPTIONS,DELETE,PROPFIND,COPY,MOVE\r\nDAV: 1,2\r\nContent-Length: 0\r\n\r\n");
+	}
+	else if( rq->method == M_LOCK )
+	{
+		char lock_headers[512];
+		char lock_body[1024];
+		printbuffer_t lb, lh;
+		static int count;
+#if 0
+		char lock_token [] = "opaquelocktoken:7028f329-f1cf-4123-a34c-dba594689257";
+		lock_token[17] += count++ % 10;
+#else
+		char lock_token [32] = "";
+		snprintf(lock_token, 31, "%d", (int)time(0));//(int)count++);//time(0));
+		//lock_token[1] += count++ % 10;
 #endif
-			if(r == 0) // child, copy the file
-			{
-				char *boundary = strcasestr( buffer, "content-type: multipart/form-data; boundary=" );
-				puts( buffer );
-				if(boundary)
-				{
-					char *boundary_end = strchr( boundary, '\r');
-					boundary += sizeof("content-type: multipart/form-data; boundary");
-					if(!boundary_end)_exit(1);
-					int boundary_len = boundary_end - boundary;
-					SV_PostUpload( newsockfd, uri, clen, boundary, boundary_len );
-				}
+		//usleep(5000);
+		RB_Dump(1, clen);
+
+		PB_Init( &lb, lock_body, 1024 );
+		PB_Init( &lh, lock_headers, 512 );
+		PB_PrintString( &lb,
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+		"<D:prop xmlns:D=\"DAV:\"><D:lockdiscovery><D:activelock>"
+		"<D:locktoken><D:href>%s</D:href></D:locktoken>"
+		"<D:lockroot><D:href>%s</D:href></D:lockroot>"
+		"</D:activelock></D:lockdiscovery></D:prop>", lock_token, uri );
+		PB_PrintString( &lh, "HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/xml; charset=utf-8\r\n"
+		"Lock-Token: <%s>\r\n"
+		"Content-Length: %d\r\n"
+		"Date: %s\r\n\r\n", lock_token, lb.pos, S_DateNow() );
+		writeall(newsockfd, lock_headers, lh.pos);
+		writeall(newsockfd, lock_body, lb.pos);
+	}
+	else if( rq->method == M_UNLOCK )
+	{
+//		writeall(newsockfd, resp_ok, strlen(resp_ok));
+		RB_Skip( clen );
+		WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\n"
+								  "Server: webserver-c\r\n"
+								  "Content-type: application/xml\r\n"
+								  "Content-Length: 0\r\n\r\n");
+	}
+	else
+	{
+		// todo: answer 4XX
+		rb->keepalive = 0;
+	}
+}
 
+static void CN_Close( conn_t *c )
+{
+	struct epoll_event ev = {0};
+
+	// a detached child still holds the socket, closing it here would not end its registration
+	epoll_ctl( epollfd, EPOLL_CTL_DEL, c->fd, &ev );
+	close( c->fd );
+	c->fd = -1;
+	c->state = CS_FREE;
+	conn_free[conn_free_count++] = c;
+	if( detached )
+		_exit( 0 );
+}
 
-				close(newsockfd);
-#ifdef ENABLE_FORK
-				_exit(0);
-#endif
-			}
-			else
-			{
-				close(newsockfd);
-				if(r < 0)
-				{
-					perror("fork");
-					close(sockfd);
-					return 1;
-				}
-			}
+static void CN_Accept( void )
+{
+	for(;;)
+	{
+		struct epoll_event ev = {0};
+		conn_t *c;
+		const int enable = 1;
+		int newsockfd = accept4( listenfd, NULL, NULL, SOCK_NONBLOCK );
+
+		if( newsockfd < 0 )
+		{
+			if( !S_Retry( newsockfd ))
+				perror("webserver (accept)");
+			return;
 		}
-		else if(!strcmp(method, "DELETE"))
+		if( !conn_free_count )
 		{
-			char *path = uri;
-			if(strstr(path, ".."))
-			{
-				close(newsockfd);
-				continue;
-			}
-			if(!strncmp(path, "/files/", 7))
-			{
-				path += 7;
-				unlink(path);
-				WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\n"
+			WriteStringLit( newsockfd, "HTTP/1.1 503 Service Unavailable\r\n"
 									   "Server: webserver-c\r\n"
-									   "Content-type: text/html\r\n\r\n"
-							   "OK");
-			}
-			close(newsockfd);
+									   "Content-Length: 0\r\n\r\n" );
+			close( newsockfd );
+			continue;
 		}
-		else if(!strcmp(method, "GET"))
-		{
-			char *path = uri;
-			if(strstr(path, ".."))
-			{
-				close(newsockfd);
-				continue;
-			}
-			if(!strncmp(path, "/list/", 6))
-			{
-				path += 6;
-				serve_list(path, newsockfd);
-			}
-			else if(!strncmp(path, "/zip/", 5))
-			{
-#ifdef ENABLE_ZIPFLOW
-//				ZIP *zip = zip_pipe( (void*)newsockfd, zflow_write, 1 );
-				ZIP *zip = zip_pipe( (void*)&newsockfd, zflow_write, 1 );
-                char *p;
-				path += 5;
-				p = strrchr( path, '.' );
-				if(p)*p = 0;
+		printf("connection accepted\n");
 
+		c = conn_free[--conn_free_count];
+		c->fd = newsockfd;
+		c->state = CS_HEADERS;
+		c->read_offset = c->ahead_offset = c->need = 0;
+		c->deadline = S_Now() + HEADER_TIMEOUT;
+		c->keepalive = 0;
+		// pipelined replies are small, do not let them wait for delayed acks
+		setsockopt( newsockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int) );
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl( epollfd, EPOLL_CTL_ADD, newsockfd, &ev );
+	}
+}
 
-				WriteStringLit( newsockfd, "HTTP/1.1 200 OK\r\n"
-								   "Server: webserver-c\r\n"
-								   "Content-Type: application/x-zip-compressed\r\n"
-								   "Content-Disposition : attachment; filename=\"folder.zip\"\r\n\r\n" );
+// offset of the first byte after the request head or -1 if not buffered yet
+static int CN_HeadEnd( conn_t *c )
+{
+	const char *head = &c->read_buffer[c->read_offset];
+	const char *end = &c->read_buffer[c->ahead_offset];
+	const char *p = head;
 
-				//SV_ZipFlow( zip, path, newsockfd );
-				zip_entry( zip, path );
-				zip_close( zip );
-				//fclose(f);//XXX what is?
-#endif
-			}
-			else if(!strcmp(path, "/indexredir"))
-			{
-				WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\n"
-										  "Server: webserver-c\r\n"
-										  "Content-type: text/html\r\n\r\n"
-										  "<html><body bgcolor=\"#000000\" link=\"#F0F0D0\"><a href=\"/index/\">list files</a></body></html>");
-			}
-			else if(!strncmp(path, "/index/", 7))
-			{
-				path += 7;
-				serve_index(path, newsockfd);
-			}
-			else if(strncmp(path, "/files/", 7))
-			{
-#ifdef ENABLE_PAGE
-				WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\n"
-										  "Server: webserver-c\r\n"
-										  "Content-type: text/html\r\n\r\n");
-				WriteStringLit(newsockfd, page_content);
-#else
-				serve_file("folderupload.html", newsockfd, "text/html", 1);
-#endif
-			}
-			else
-			{
-				int r = 0;
-#ifdef ENABLE_FORK
-				r =fork();
-#endif
-				if( r == 0 )
-				{
-					char *rng = strcasestr( buffer, "\nrange: bytes=" );
-					path += 7;
-					puts(buffer);
-					if( rng )
-					{
-						char *rng1;
-						rng += sizeof( "\nrange: bytes" );
-						rng1 = strchr(rng, '-');
-						if(rng1)
-							serve_file_range(path, newsockfd, "application/octet-stream", atoi(rng), atoi(rng1));
-					}
-					else
-						serve_file(path, newsockfd, "application/octet-stream", 1);
-				}
-				else
-				{
-					close(newsockfd);
-					if(r < 0)
-					{
-							perror("fork");
-							close(sockfd);
-							return 1;
-					}
-				}
-			}
+	// the head ends at a line feed followed by an empty line, with or without CR
+	while(( p = S_FindByte( p, end, '\n' )))
+	{
+		if( p + 1 < end && p[1] == '\n' )
+			return p + 2 - head;
+		if( p + 2 < end && p[1] == '\r' && p[2] == '\n' )
+			return p + 3 - head;
+		p++;
+	}
+	return -1;
+}
 
-			close(newsockfd);
-		}
-		else if(!strcmp(method, "HEAD"))
+/* requests that can keep the socket busy for long: uploads whose body is
+   mostly still to come, zip streams and large files. 2 for zip uploads,
+   which must not run in the worker: sunzip exits on a broken archive */
+static int CN_Long( conn_t *c )
+{
+	request_t *rq = &c->req;
+	const char *value;
+	struct stat sb;
+
+	if( rq->method == M_PUT && !strncmp( rq->uri, "/zip/", 5 ))
+		return 2;
+	if( rq->method == M_PUT || rq->method == M_POST )
+	{
+		if(( value = RQ_Header( rq, "transfer-encoding" )) && strcasestr( value, "chunked" ))
+			return 1;
+		value = RQ_Header( rq, "content-length" );
+		return value && S_atoll( value ) - (off_t)( c->ahead_offset - c->read_offset ) > DETACH_BODY;
+	}
+	if( rq->method != M_GET )
+		return 0;
+	if( !strncmp( rq->uri, "/zip/", 5 ))
+		return 1;
+	return !strncmp( rq->uri, "/files/", 7 ) && !stat( rq->uri + 7, &sb ) &&
+		( sb.st_mode & S_IFMT ) == S_IFREG && sb.st_size >= DETACH_FILE;
+}
+
+/* hand the connection to a child, so the worker goes on with the others
+   while the transfer runs. The child keeps only this socket and serves it,
+   persistent requests included, until it is closed. Returns 1 in the
+   worker, which has forgotten the connection, 0 in the child or if there
+   is no child */
+static int CN_Detach( conn_t *c )
+{
+	struct epoll_event ev = {0};
+	int i, pid;
+
+	while( children && waitpid( -1, NULL, WNOHANG ) > 0 )
+		children--;
+	if( children >= DETACH_MAX || ( pid = fork()) < 0 )
+		return 0; // served here after all
+	if( pid )
+	{
+		children++;
+		CN_Close( c );
+		return 1;
+	}
+	detached = 1;
+	children = 0;
+	close( epollfd );
+	close( listenfd );
+	for( i = 0; i < MAX_CONNECTIONS; i++ )
+		if( connections[i].fd >= 0 && &connections[i] != c )
 		{
-			char *path = uri;
+			close( connections[i].fd ); // or the worker could not hang up on them
+			connections[i].fd = -1; // the number may be reused, expiry must not close it
+			connections[i].state = CS_FREE;
+		}
+	if( splice_pipe[0] >= 0 )
+		S_PipeDrop(); // the worker goes on using its pipe
+	epollfd = epoll_create1( 0 );
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if( epollfd >= 0 && epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &ev ))
+	{
+		close( epollfd );
+		epollfd = -1; // no loop to go back to, only this request is served
+	}
+	return 0;
+}
 
-			//usleep(15000);
+static void CN_Process( conn_t *c )
+{
+	int eof = 0, long_req;
 
-			RB_Dump( 1, clen );
+	rb = c;
 
-			if(strncmp(path, "/files/", 7) || strstr(path, ".."))
-			{
-				close(newsockfd);
-				continue;
-			}
-			path += 7;
-			struct stat sb;
-				if(!stat(path,&sb))
-				{
-					const char *fname = strrchr(path, '/');
-					printbuffer_t resp;
-					if(!fname) fname = path;
-					else fname++;
-
-					PB_Init( &resp, buffer, sizeof( buffer ) - 1);
-					PB_PrintString( &resp,
-								   "HTTP/1.1 200 OK\r\n"
-								   "Server: webserver-c\r\n"
-								   "etag: %d-%d\r\n"
-								   "Content-Type: %s\r\n"
-								   "Content-Length: %d\r\n"
-								   "Accept-Ranges: bytes\r\n"
-								   "Date: Sat, 11 Nov 2023 21:55:54 GMT\r\n"
-								   "Content-Disposition : inline; filename=\"%s\"\r\n\r\n", (int)time(0), (int)sb.st_size, "text/plain", (int)sb.st_size, fname );
-					writeall( newsockfd, buffer, resp.pos );
-					printf("HEAD %s %s %d\n", path, fname, (int)sb.st_size);
-				}
-				else
-					WriteStringLit(newsockfd, "HTTP/1.1 404 Not found\r\n"
-											  "Server: webserver-c\r\n"
-											  "Content-Length:0\r\n"
-											  "\r\n");
-			close(newsockfd);
+	// take everything the socket has right now
+	for(;;)
+	{
+		size_t space = READ_BUFFER_SIZE - c->ahead_offset;
+		int res;
+
+		if( !space )
+			break;
+		res = read( c->fd, &c->read_buffer[c->ahead_offset], space );
+		if( res > 0 )
+		{
+			// an idle connection starts a new request
+			if( c->state == CS_HEADERS && !c->ahead_offset )
+				c->deadline = S_Now() + HEADER_TIMEOUT;
+			c->ahead_offset += res;
+			continue;
 		}
-		else if(!strcmp(method, "MKCOL"))
+		if( S_Retry( res ))
+			break;
+		if( res < 0 || !c->ahead_offset )
 		{
-			char *path = uri;
-			if(strncmp(path, "/files/", 7) || strstr(path, ".."))
-			{
-				close(newsockfd);
-				continue;
-			}
-			path += 7;
-			create_directories(path);
-			mkdir(path, 0777);
-			puts(buffer);
-			//usleep(10000);
-
-			RB_Dump(1, clen);
-			WriteStringLit(newsockfd,"HTTP/1.1 201 Created\r\n"
-									  "Server: webserver-c\r\n\r\n" )
-			close(newsockfd);
+			CN_Close( c ); // client went away
+			return;
 		}
-		else if(!strcmp(method, "PROPPATCH"))
+		eof = 1; // half-closed, still answer what was sent
+		break;
+	}
+
+	// serve every request that is already buffered, in order
+	for(;;)
+	{
+		if( c->state == CS_HEADERS )
 		{
-			char *path = uri;
-			PB_DeclareString( resp_ok, 1024,  "HTTP/1.1 207 Multi-Status\r\n"
-											"Server: webserver-c\r\n"
-											"Content-type: application/xml\r\n\r\n"
-											"<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:multistatus xmlns:D=\"DAV:\"><D:response><D:href>" );
-			if(strncmp(path, "/files/", 7) || strstr(path, ".."))
+			int headend;
+
+			// stray line breaks between requests are allowed
+			while( c->read_offset < c->ahead_offset && ( c->read_buffer[c->read_offset] == '\r' || c->read_buffer[c->read_offset] == '\n' ))
+				c->read_offset++;
+			headend = CN_HeadEnd( c );
+			if( headend < 0 )
 			{
-				close(newsockfd);
-				continue;
+				if( c->ahead_offset >= READ_BUFFER_SIZE )
+				{
+					WriteStringLit( c->fd, "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+										   "Server: webserver-c\r\n"
+										   "Content-Length: 0\r\n\r\n" );
+					CN_Close( c );
+				}
+				else if( eof )
+					CN_Close( c );
+				return;
 			}
-			printf("%s\n", buffer);
-			RB_Dump(1, clen);
-			PB_WriteString( &resp_ok, uri );
-			PB_WriteStringLit( &resp_ok, "</D:href><D:propstat><D:prop></D:prop><D:status>HTTP/1.1 403 Forbidden</D:status></D:propstat></D:response></D:multistatus>");
-			writeall(newsockfd, resp_ok_buffer, resp_ok.pos );
 
-			close(newsockfd);
-		}
-		else if(!strcmp(method, "MOVE"))
-		{
-			char *path = uri;
-			const char *dest;
-			if(strncmp(path, "/files/", 7) || strstr(path, ".."))
+			if( !RQ_Parse( &c->req, &c->read_buffer[c->read_offset], headend ))
 			{
-				close(newsockfd);
-				continue;
+				WriteStringLit( c->fd, "HTTP/1.1 400 Bad Request\r\n"
+									   "Server: webserver-c\r\n"
+									   "Content-Length: 0\r\n\r\n" );
+				CN_Close( c );
+				return;
 			}
-			path += 7;
-
-			RB_Dump(1, clen);
-			dest = strcasestr(buffer, "destination: ");
-			if(dest)
+			c->read_offset += headend;
+			c->need = 0;
+			// uploads are streamed by their handlers, other bodies are small and
+			// buffered here so the handler never waits for the client
+			if( c->req.method != M_PUT && c->req.method != M_POST )
 			{
-				char *e1 = strstr(dest, "\n");
-				char *e2 = strstr(dest, "\r\n");
-				if(e2 && e2 < e1)
-					e1 = e2;
-				*e1 = 0;
-				dest += sizeof("destination: " ) - 1;
-				printf("move %s %s\n", path, dest);
-				if(!strncmp(dest, "/files/", 7) && !strstr(dest, ".."))
+				const char *contentlength = RQ_Header( &c->req, "content-length" );
+				if( contentlength )
 				{
-					dest += 7;
-					rename(path, dest);
+					off_t clen = S_atoll( contentlength );
+					if( clen > 0 && c->read_offset + clen <= READ_BUFFER_SIZE )
+						c->need = clen;
 				}
 			}
+			c->state = CS_BODY;
+		}
 
-			WriteStringLit(newsockfd,  "HTTP/1.1 201 Created\r\n"
-										  "Server: webserver-c\r\n"
-										  "Content-type: text/html\r\n\r\n"
-										  "OK");
-			close(newsockfd);
+		if( c->ahead_offset - c->read_offset < c->need )
+		{
+			if( eof )
+				CN_Close( c );
+			return;
 		}
-		else if(!strcmp(method, "PROPFIND"))
+
+		if( !detached && ( long_req = CN_Long( c )))
 		{
-			char *path = uri;
-			const char resp_auth[] = "HTTP/1.1 401 Unauthorized\r\n"
-								   "Server: webserver-c\r\n"
-								   "WWW-Authenticate: Basic realm=\"User Visible Realm\"\r\n\r\n";
-			RB_Dump(1, clen);
-			/*if(!strcasestr(buffer, "authorization: "))
-			{
-				writeall(newsockfd, resp_auth, sizeof(resp_auth) - 1);
-				close(newsockfd);
-			}*/
-            if(path[0]=='/' && path[1] == '\0')
-            {
-               path="/files";
-            }
-			if(strncmp(path, "/files", 6) || strstr(path, ".."))
-			{
-				serve_path_dav("", newsockfd);
-				close(newsockfd);
-				continue;
-			}
-			path += 7;
-			printf("%s\n", buffer);
-			if(strcasestr( buffer, "Depth: 0" ))
-			{
-				serve_path_dav(path, newsockfd);
-			}
-			else
+			if( CN_Detach( c ))
+				return;
+			if( !detached && long_req == 2 )
 			{
-				serve_list_dav(path, newsockfd);
+				WriteStringLit( c->fd, "HTTP/1.1 503 Service Unavailable\r\n"
+									   "Server: webserver-c\r\n"
+									   "Connection: close\r\n"
+									   "Content-Length: 0\r\n\r\n" );
+				CN_Close( c );
+				return;
 			}
-
-			close(newsockfd);
 		}
-		else if(!strcmp(method, "OPTIONS"))
+
+		SV_Request();
+		if( !c->keepalive || epollfd < 0 )
 		{
-			/*"HTTP/1.1 200 OK\r\n"
-			"Content-Type: text/plain\r\n"
-			"Access-Control-Allow-Methods: PROPFIND, PROPPATCH, COPY, MOVE, DELETE, MKCOL, PUT, UNLOCK, GETLIB, VERSION-CONTROL, CHECKIN, CHECKOUT, UNCHECKOUT, REPORT, UPDATE, CANCELUPLOAD, HEAD, OPTIONS, GET, POST\r\n"
-			"Access-Control-Allow-Headers: Overwrite, Destination, Content-Type, Depth, User-Agent, X-File-Size, X-Requested-With, If-Modified-Since, X-File-Name, Cache-Control\r\n"
-			"Access-Control-Max-Age: 86400\r\n\r\n";*/
-			//if( valread >= 0)
-			RB_Dump(1, clen);
-			WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\nAllow: GET,HEAD,PUT,OPTIONS,DELETE,PROPFIND,COPY,MOVE\r\nDAV: 1,2\r\nContent-Length: 0\r\n\r\n");
-			close(newsockfd);
+			CN_Close( c );
+			return;
 		}
-		else if(!strcmp(method, "LOCK"))
+
+		// keep the bytes of the next request, the head parser wants them at the start
+		RB_Compact();
+		c->need = 0;
+		c->state = CS_HEADERS;
+		c->deadline = S_Now() + ( c->ahead_offset ? HEADER_TIMEOUT : KEEPALIVE_TIMEOUT );
+	}
+}
+
+// drop clients that did not send a request in time
+static void CN_Expire( void )
+{
+	long now = S_Now();
+	int i;
+
+	for( i = 0; i < MAX_CONNECTIONS; i++ )
+		if( connections[i].fd >= 0 && connections[i].deadline < now )
+			CN_Close( &connections[i] );
+}
+
+static void CN_Loop( void )
+{
+	struct epoll_event ev = {0};
+	struct epoll_event events[MAX_EVENTS];
+	long last_expire = S_Now();
+	int i;
+
+	for( i = 0; i < MAX_CONNECTIONS; i++ )
+	{
+		connections[i].fd = -1;
+		conn_free[i] = &connections[MAX_CONNECTIONS - 1 - i];
+	}
+	conn_free_count = MAX_CONNECTIONS;
+
+	epollfd = epoll_create1( 0 );
+	if( epollfd < 0 )
+	{
+		perror("webserver (epoll)");
+		return;
+	}
+	// every worker waits on the same listening socket, only an idle one is woken
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL; // the listening socket
+	epoll_ctl( epollfd, EPOLL_CTL_ADD, listenfd, &ev );
+
+	for (;;) {
+		int n = epoll_wait( epollfd, events, MAX_EVENTS, 1000 );
+
+		for( i = 0; i < n; i++ )
 		{
-			char lock_headers[512];
-			char lock_body[1024];
-			printbuffer_t lb, lh;
-			static int count;
-#if 0
-			char lock_token [] = "opaquelocktoken:7028f329-f1cf-4123-a34c-dba594689257";
-			lock_token[17] += count++ % 10;
-#else
-			char lock_token [32] = "";
-			snprintf(lock_token, 31, "%d", (int)time(0));//(int)count++);//time(0));
-			//lock_token[1] += count++ % 10;
-#endif
-			//usleep(5000);
-			RB_Dump(1, clen);
-
-			PB_Init( &lb, lock_body, 1024 );
-			PB_Init( &lh, lock_headers, 512 );
-			PB_PrintString( &lb,
-			"<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-			"<D:prop xmlns:D=\"DAV:\"><D:lockdiscovery><D:activelock>"
-			"<D:locktoken><D:href>%s</D:href></D:locktoken>"
-			"<D:lockroot><D:href>%s</D:href></D:lockroot>"
-			"</D:activelock></D:lockdiscovery></D:prop>", lock_token, uri );
-			PB_PrintString( &lh, "HTTP/1.1 200 OK\r\n"
-			"Content-Type: application/xml; charset=utf-8\r\n"
-			"Lock-Token: <%s>\r\n"
-			"Content-Length: %d\r\n"
-			"Date: Fri, 10 Nov 2023 23:45:40 GMT\r\n\r\n", lock_token, lb.pos );
-			writeall(newsockfd, lock_headers, lh.pos);
-			writeall(newsockfd, lock_body, lb.pos);
-			close(newsockfd);
+			conn_t *c = events[i].data.ptr;
+
+			if( !c )
+				CN_Accept();
+			else if( c->fd >= 0 )
+				CN_Process( c );
 		}
-		else if(!strcmp(method, "UNLOCK"))
+
+		if( S_Now() != last_expire )
 		{
-//			writeall(newsockfd, resp_ok, strlen(resp_ok));
-			WriteStringLit(newsockfd, "HTTP/1.1 200 OK\r\n"
-									  "Server: webserver-c\r\n"
-									  "Content-type: application/xml\r\n\r\n");
-			close(newsockfd);
+			last_expire = S_Now();
+			CN_Expire();
+			while( children && waitpid( -1, NULL, WNOHANG ) > 0 ) // detached transfers that ended
+				children--;
+		}
+	}
+}
 
+#ifdef ENABLE_FORK
+/* keep a fixed number of workers alive, each one runs its own event loop.
+   Long transfers are handed to a child of the worker, see CN_Detach */
+static int SV_Workers( int count )
+{
+	int alive = 0;
+
+	for (;;) {
+		while( alive < count )
+		{
+			int r = fork();
+			if( r == 0 )
+			{
+				prctl( PR_SET_PDEATHSIG, SIGTERM ); // do not outlive the master
+				CN_Loop();
+				_exit(1);
+			}
+			if( r < 0 )
+			{
+				perror("fork");
+				if( !alive )
+					return 1;
+				break;
+			}
+			alive++;
 		}
-		else
+		if( waitpid( -1, NULL, 0 ) > 0 )
 		{
-			// todo: answer 4XX
-			close(newsockfd);
+			printf("worker exited, restarting\n");
+			alive--;
 		}
 	}
+}
+#endif
+
+int main(int argc, char **argv, char **envp) {
+	int sockfd;
+	unsigned short port = PORT;
+	int workers = WORKERS;
+
+	//printf("%d %p %p\n", argc, argv, envp);
+	if(argc >= 3)
+	{
+		chdir(argv[1]);
+		port = atoi(argv[2]);
+	}
+#if defined(ENABLE_ZLIB) && defined(ENABLE_LIBC)
+	HC_Open();
+#endif
+	DC_Open();
+	if(argc >= 4)
+		workers = atoi(argv[3]);
+	if(workers < 1)
+		workers = 1;
+
+	// Create a socket
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd == -1) {
+		perror("webserver (socket)");
+		return 1;
+	}
+	printf("socket created successfully\n");
+	const int enable = 1;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+		perror("setsockopt(SO_REUSEADDR) failed");
+	// Create the address to bind the socket to
+	struct sockaddr_in host_addr;
+	int host_addrlen = sizeof(host_addr);
+
+	host_addr.sin_family = AF_INET;
+	host_addr.sin_port = htons(port);
+	host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	// Bind the socket to the address
+	if (bind(sockfd, (struct sockaddr *)&host_addr, host_addrlen) != 0) {
+		perror("webserver (bind)");
+		return 1;
+	}
+	printf("socket successfully bound to address\n");
+
+	// Listen for incoming connections
+	if (listen(sockfd, SOMAXCONN) != 0) {
+		perror("webserver (listen)");
+		return 1;
+	}
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+	printf("server listening for connections: http://localhost:%d\n",PORT);
+
+	listenfd = sockfd;
+#ifdef ENABLE_FORK
+	printf("starting %d workers\n", workers);
+	if( SV_Workers( workers ))
+		return 1;
+#else
+	CN_Loop();
+#endif
 
 	close(sockfd);
 	return 0;
@@ -103,8 +103,10 @@
 #include <sys/stat.h>   /* mkdir(), stat() */
 #include <errno.h>      /* errno, EEXIST */
 #include <dirent.h>     /* opendir(), readdir(), closedir() */
+#include <pthread.h>    /* pthread_create(), pthread_join(), mutexes */
 #include "zlib.h"       /* crc32(), z_stream, inflateBackInit(), */
 						/*   inflateBack(), inflateBackEnd() */
+#include "../include/crc32fold.h" /* S_Crc32() */
 #ifndef JUST_DEFLATE
 #include "infback9.h"   /* inflateBack9Init(), inflate9Back(), */
 						/*   inflateBack9End() */
@@ -134,24 +136,11 @@ static inline int sunzip_write(sunzip_file_out file, const void *buf, size_t sz)
 {
 	return write( file, buf, sz );
 }
-static void create_directories(const char *path)
-{
-	const char *dir_begin = path, *dir_begin_next;
-	char dir_path[PATH_MAX] = "";
-	//size_t dir_len = 0;
-	while((dir_begin_next = strchr(dir_begin, '/') ))
-	{
-		dir_begin_next++;
-		memcpy(&dir_path[0] + (dir_begin - path), dir_begin, dir_begin_next - dir_begin);
-		//printf("mkdir %s\n",dir_path);
-		mkdir(dir_path, 0777);
-		dir_begin = dir_begin_next;
-	}
-}
+#include <sys/mman.h>
+#include "../include/dircache.h"
 static inline sunzip_file_out sunzip_openout(const char *filename)
 {
-	create_directories(filename);
-	return open(filename, O_WRONLY | O_CREAT, 0666);
+	return DC_Create(filename, O_WRONLY | O_CREAT, 0666);
 }
 static inline int sunzip_closeout(sunzip_file_out file)
 {
@@ -200,7 +189,18 @@ static inline int sunzip_read(sunzip_file_in file, void *buffer, size_t size)
 #    error Unexpected size of long data type
 #  endif
 #endif
-#define NOCRC 1
+#ifndef NOCRC
+#define NOCRC 0 /* 1 skips the check of extracted data */
+#endif
+#ifndef WRITE_BEHIND
+#define WRITE_BEHIND 1 /* 0 writes from the inflating thread */
+#endif
+#ifndef SUNZIP_DUMP
+#define SUNZIP_DUMP 0 /* 1 if the integration provides sunzip_dump() */
+#endif
+#ifndef UNZIP_THREADS
+#define UNZIP_THREADS 8 /* most inflate workers, 0 or 1 inflates serially */
+#endif
 #define SKIP_CENTRAL
 /* systems for which mkdtemp() is not provided */
 #ifdef VMS
@@ -243,11 +243,197 @@ struct out {
 	unsigned long count_hi;     /* count overflow */
 };
 
-/* process inflate output, writing if requested */
-local int put(void *out_desc, unsigned char *buf, unsigned len)
+/* write all of buf, return true on error */
+local int write_all(sunzip_file_out file, unsigned char *buf, unsigned long len)
 {
 	int wrote;
 	unsigned try;
+
+	while (len) {   /* loop since write() may not complete request */
+		try = len >= 32768U ? 16384 : len;
+		wrote = sunzip_write(file, buf, try);
+		if (wrote == -1)
+			return 1;
+		len -= wrote;
+		buf += wrote;
+	}
+	return 0;
+}
+
+#if WRITE_BEHIND
+/* Write-behind: put() copies output into a ring and queues the write, a
+   writer thread does the write() and close() calls, so inflation of the next
+   slice or entry overlaps the disk.  There is one producer and one writer.
+   The writer copies an op under the lock and works on it unlocked, so only
+   ops after the one at tail may still be extended. */
+#define WB_RING (4UL << 20)     /* bytes of output in flight */
+#define WB_OPS 4096             /* writes and closes in flight */
+
+struct wbop {
+	sunzip_file_out file;
+	unsigned long off;          /* offset in ring */
+	unsigned long len;          /* bytes to write, 0 to close file */
+};
+
+local struct {
+	int on;                     /* true if the writer thread is running */
+	int err;                    /* true if a write or close failed */
+	int stop;                   /* true when no more ops will come */
+	unsigned char *ring;
+	struct wbop op[WB_OPS];
+	unsigned long head, tail;   /* ops queued and done */
+	unsigned long fill, drain;  /* bytes queued and written */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t more, room;
+} wb = { 0, 0, 0, NULL, {{0}}, 0, 0, 0, 0, 0,
+		 PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+		 PTHREAD_COND_INITIALIZER };
+
+local void *wb_writer(void *arg)
+{
+	struct wbop op;
+	int fail;
+
+	(void)arg;
+	pthread_mutex_lock(&wb.lock);
+	for (;;) {
+		while (wb.tail == wb.head && !wb.stop)
+			pthread_cond_wait(&wb.more, &wb.lock);
+		if (wb.tail == wb.head)
+			break;
+		op = wb.op[wb.tail % WB_OPS];
+		pthread_mutex_unlock(&wb.lock);
+		if (op.len)
+			fail = write_all(op.file, wb.ring + op.off, op.len);
+		else
+			fail = sunzip_closeout(op.file) != 0;
+		pthread_mutex_lock(&wb.lock);
+		wb.err |= fail;
+		wb.tail++;
+		wb.drain += op.len;
+		pthread_cond_signal(&wb.room);
+	}
+	pthread_mutex_unlock(&wb.lock);
+	return NULL;
+}
+
+/* start the writer, without memory or a thread output is written directly */
+local void wb_start(void)
+{
+	if (wb.ring == NULL)
+		wb.ring = malloc(WB_RING);
+	wb.err = wb.stop = 0;
+	wb.head = wb.tail = wb.fill = wb.drain = 0;
+	wb.on = wb.ring != NULL &&
+			pthread_create(&wb.thread, NULL, wb_writer, NULL) == 0;
+}
+
+/* queue an op, waiting for a free slot -- called with the lock held */
+local void wb_queue(sunzip_file_out file, unsigned long off, unsigned long len)
+{
+	struct wbop *op;
+
+	while (wb.head - wb.tail == WB_OPS)
+		pthread_cond_wait(&wb.room, &wb.lock);
+	op = wb.op + wb.head % WB_OPS;
+	op->file = file;
+	op->off = off;
+	op->len = len;
+	wb.head++;
+	pthread_cond_signal(&wb.more);
+}
+
+/* copy buf into the ring and queue its write, return true on error */
+local int wb_write(sunzip_file_out file, unsigned char *buf, unsigned long len)
+{
+	unsigned long pos, n;
+	struct wbop *last;
+	int err;
+
+	if (!wb.on)
+		return write_all(file, buf, len);
+	pthread_mutex_lock(&wb.lock);
+	while (len && !wb.err) {
+		while (wb.fill - wb.drain == WB_RING)
+			pthread_cond_wait(&wb.room, &wb.lock);
+		pos = wb.fill % WB_RING;
+		n = WB_RING - (wb.fill - wb.drain);
+		if (n > WB_RING - pos)
+			n = WB_RING - pos;
+		if (n > len)
+			n = len;
+		pthread_mutex_unlock(&wb.lock);
+		memcpy(wb.ring + pos, buf, n);  /* free space is only ours */
+		pthread_mutex_lock(&wb.lock);
+		last = wb.op + (wb.head - 1) % WB_OPS;
+		if (wb.head - wb.tail >= 2 && last->file == file && last->len &&
+			last->off + last->len == pos)
+			last->len += n;             /* not taken yet, extend it */
+		else
+			wb_queue(file, pos, n);
+		wb.fill += n;
+		buf += n;
+		len -= n;
+	}
+	err = wb.err;
+	pthread_mutex_unlock(&wb.lock);
+	return err;
+}
+
+/* wait until all queued ops are done, return true on an error so far */
+local int wb_sync(void)
+{
+	int err;
+
+	if (!wb.on)
+		return 0;
+	pthread_mutex_lock(&wb.lock);
+	while (wb.tail != wb.head)
+		pthread_cond_wait(&wb.room, &wb.lock);
+	err = wb.err;
+	pthread_mutex_unlock(&wb.lock);
+	return err;
+}
+
+/* close file after its queued writes, return true on an error so far */
+local int wb_close(sunzip_file_out file)
+{
+	int err;
+
+	if (!wb.on)
+		return sunzip_closeout(file) != 0;
+	pthread_mutex_lock(&wb.lock);
+	wb_queue(file, 0, 0);
+	err = wb.err;
+	pthread_mutex_unlock(&wb.lock);
+	return err;
+}
+
+/* wait until everything is written and closed, return true on error */
+local int wb_end(void)
+{
+	if (!wb.on)
+		return 0;
+	pthread_mutex_lock(&wb.lock);
+	wb.stop = 1;
+	pthread_cond_signal(&wb.more);
+	pthread_mutex_unlock(&wb.lock);
+	pthread_join(wb.thread, NULL);
+	wb.on = 0;
+	return wb.err;
+}
+#else
+#  define wb_start()
+#  define wb_write(file, buf, len) write_all(file, buf, len)
+#  define wb_close(file) (sunzip_closeout(file) != 0)
+#  define wb_sync() 0
+#  define wb_end() 0
+#endif
+
+/* process inflate output, writing if requested */
+local int put(void *out_desc, unsigned char *buf, unsigned len)
+{
 	struct out *out = (struct out *)out_desc;
 
 #ifndef BIGINT
@@ -260,25 +446,46 @@ local int put(void *out_desc, unsigned char *buf, unsigned len)
 #endif
 #if !NOCRC
 	/* update crc and output byte count */
-	out->crc = crc32(out->crc, buf, len);
+	out->crc = S_Crc32(out->crc, buf, len);
 #endif
 	out->count += len;
 	if (out->count < len)
 		out->count_hi++;
-	if (sunzip_out_valid(out->file))
-	{
-		while (len) {   /* loop since write() may not complete request */
-			try = len >= 32768U ? 16384 : len;
-			wrote = sunzip_write(out->file, buf, try);
-			if (wrote == -1)
-				bye("write error");
-			len -= wrote;
-			buf += wrote;
-		}
-	}
+	if (sunzip_out_valid(out->file) && wb_write(out->file, buf, len))
+		bye("write error");
 	return 0;
 }
 
+#if SUNZIP_DUMP
+/* Stored entries of at least DUMP_MIN bytes go from the input to the file
+   with sunzip_dump(), which need not pass them through memory here.  The
+   check value is then computed by reading back what landed in the file,
+   while it is still cached, which also catches a short write. */
+#define DUMP_MIN 524288
+
+/* account for len bytes put in out by sunzip_dump(), buf is scratch space
+   of size bytes */
+local void put_back(struct out *out, unsigned long len,
+					unsigned char *buf, unsigned size)
+{
+	ssize_t got;
+
+	while (len) {
+		got = pread(out->file, buf, len < size ? len : size,
+					(off_t)out->count + ((off_t)out->count_hi << 32));
+		if (got <= 0)
+			return;             /* missing bytes fail the length check */
+#if !NOCRC
+		out->crc = S_Crc32(out->crc, buf, got);
+#endif
+		out->count += got;
+		if (out->count < (unsigned long)got)
+			out->count_hi++;
+		len -= got;
+	}
+}
+#endif
+
 /* structure for input acquisition and processing */
 struct in {
 	sunzip_file_in file;                   /* input file */
@@ -548,6 +755,229 @@ local void bad(char *why, unsigned long entry,
 		sunzip_printerr("%lx\n", here);
 }
 
+#if UNZIP_THREADS > 1
+/* Parallel inflation: deflated entries whose lengths are in the local header
+   are copied out of the stream whole and inflated by a pool of workers, each
+   of which writes and closes its file, while the caller goes on reading the
+   next entries.  Entries with deferred lengths, larger ones, and other methods
+   are still done by the caller, since only inflating finds their end.  The
+   caller reports the results of queued entries in order. */
+#define UNZIP_ENTRY (8UL << 20)     /* largest compressed entry to queue */
+#define UNZIP_HOLD (64UL << 20)     /* compressed bytes queued at most */
+#define UNZIP_PENDING 256           /* queued entries, each has a file open */
+
+struct job {
+	struct job *next;           /* next entry in stream order */
+	struct out out;             /* output file, closed by the worker */
+	unsigned long crc, ulen;    /* check values from the local header */
+	unsigned long entry, here, here_hi;     /* for reporting */
+	char *err;                  /* what was wrong, NULL if good */
+	int failed;                 /* true on a write or close error */
+	int done;                   /* true when the worker is done */
+	unsigned long clen;         /* compressed length */
+	unsigned char data[];       /* compressed data */
+};
+
+/* the caller alone changes head, tail, held and pending -- take, quit and
+   done are shared with the workers under the lock */
+local struct {
+	int threads;                /* running workers, 0 to inflate serially */
+	int tried;                  /* true once a start was attempted */
+	int quit;                   /* true to make idle workers return */
+	struct job *head, *tail;    /* oldest and newest queued entries */
+	struct job *take;           /* next entry for a worker, NULL if none */
+	unsigned long held;         /* compressed bytes of queued entries */
+	unsigned pending;           /* number of queued entries */
+	pthread_t tid[UNZIP_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+} pool = { 0, 0, 0, NULL, NULL, NULL, 0, 0, {0},
+		   PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+		   PTHREAD_COND_INITIALIZER };
+
+/* inflateBack() input of a queued entry -- all of it was given up front */
+local unsigned get_none(void *in_desc, unsigned char **buf)
+{
+	(void)in_desc;
+	*buf = NULL;
+	return 0;
+}
+
+/* inflateBack() output of a queued entry, written by the worker */
+local int put_job(void *out_desc, unsigned char *buf, unsigned len)
+{
+	struct job *job = (struct job *)out_desc;
+
+#if !NOCRC
+	job->out.crc = S_Crc32(job->out.crc, buf, len);
+#endif
+	job->out.count += len;
+	if (job->out.count < len)
+		job->out.count_hi++;
+	if (write_all(job->out.file, buf, len)) {
+		job->failed = 1;
+		return 1;
+	}
+	return 0;
+}
+
+local void inflate_job(z_stream *strm, struct job *job)
+{
+	int ret;
+
+	job->out.crc = crc32(0L, Z_NULL, 0);
+	job->out.count = job->out.count_hi = 0;
+	strm->next_in = job->data;
+	strm->avail_in = job->clen;
+	ret = inflateBack(strm, get_none, NULL, put_job, job);
+	if (sunzip_closeout(job->out.file))
+		job->failed = 1;
+	if (ret != Z_STREAM_END)
+		job->err = "deflate compressed data corrupted";
+	else if (strm->avail_in || job->out.count_hi || job->ulen != job->out.count
+			 || (!NOCRC && job->crc != job->out.crc))
+		job->err = "compressed data corrupted, check values mismatch";
+}
+
+local void *inflater(void *arg)
+{
+	struct job *job;
+	z_stream strms, *strm = &strms;
+	unsigned char *window = malloc(32768U);
+	int ok;
+
+	(void)arg;
+	strm->zalloc = Z_NULL;
+	strm->zfree = Z_NULL;
+	strm->opaque = Z_NULL;
+	ok = window != NULL && inflateBackInit(strm, 15, window) == Z_OK;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.take == NULL && !pool.quit)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if ((job = pool.take) == NULL)
+			break;
+		pool.take = job->next;
+		pthread_mutex_unlock(&pool.lock);
+		if (ok)
+			inflate_job(strm, job);
+		else {
+			job->err = "out of memory";
+			if (sunzip_closeout(job->out.file))
+				job->failed = 1;
+		}
+		pthread_mutex_lock(&pool.lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	if (ok)
+		inflateBackEnd(strm);
+	free(window);
+	return NULL;
+}
+
+/* start the workers once, return true if there are any */
+local int pool_start(void)
+{
+	long cpus;
+
+	if (pool.tried)
+		return pool.threads != 0;
+	pool.tried = 1;
+	pool.quit = 0;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > UNZIP_THREADS)
+		cpus = UNZIP_THREADS;
+	if (cpus < 2)
+		return 0;
+	while (pool.threads < cpus &&
+		   pthread_create(pool.tid + pool.threads, NULL, inflater, NULL) == 0)
+		pool.threads++;
+	return pool.threads != 0;
+}
+
+/* report and free the oldest queued entry, waiting for it if needed */
+local void pool_reap(void)
+{
+	struct job *job = pool.head;
+
+	pthread_mutex_lock(&pool.lock);
+	while (!job->done)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	pool.head = job->next;
+	if (pool.head == NULL)
+		pool.tail = NULL;
+	pool.held -= job->clen;
+	pool.pending--;
+	if (job->failed)
+		bye("write error");
+	if (job->err != NULL)
+		bad(job->err, job->entry, job->here, job->here_hi);
+	free(job);
+}
+
+/* report finished entries, all of them if wait is true */
+local void pool_drain(int wait)
+{
+	int done;
+
+	while (pool.head != NULL) {
+		pthread_mutex_lock(&pool.lock);
+		done = pool.head->done;
+		pthread_mutex_unlock(&pool.lock);
+		if (!done && !wait)
+			break;
+		pool_reap();
+	}
+}
+
+/* hand a filled in entry to the workers, making room first */
+local void pool_queue(struct job *job)
+{
+	pool_drain(0);
+	while (pool.head != NULL && (pool.pending >= UNZIP_PENDING ||
+								 pool.held + job->clen > UNZIP_HOLD))
+		pool_reap();
+	job->next = NULL;
+	job->done = 0;
+	job->failed = 0;
+	job->err = NULL;
+	pool.held += job->clen;
+	pool.pending++;
+	pthread_mutex_lock(&pool.lock);
+	if (pool.tail == NULL)
+		pool.head = job;
+	else
+		pool.tail->next = job;
+	pool.tail = job;
+	if (pool.take == NULL)
+		pool.take = job;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* wait for all queued entries and stop the workers */
+local void pool_end(void)
+{
+	int i;
+
+	pool_drain(1);
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.threads; i++)
+		pthread_join(pool.tid[i], NULL);
+	pool.threads = pool.tried = 0;
+}
+#else
+#  define pool_start() 0
+#  define pool_drain(wait)
+#  define pool_end()
+#endif
+
 /* macro to check actual crc and lengths against expected */
 #ifdef BIGLONG
 #  define GOOD() ((NOCRC || out->crc == crc) && \
@@ -614,6 +1044,10 @@ void sunzip(sunzip_file_in file, int write)
 	z_stream strms9, *strm9 = NULL;     /* inflate9 structure */
 #endif
 	char filepath[1024];
+	int queued;                         /* true if a worker has the entry */
+#if UNZIP_THREADS > 1
+	struct job *job;                    /* entry for a worker */
+#endif
 #ifdef BIGINT
 	static int32_t inbuf_s[CHUNK / sizeof(int)], outbuf_s[16384];
 #else
@@ -635,6 +1069,8 @@ void sunzip(sunzip_file_in file, int write)
 	in->offset_hi = 0;
 
 	/* process zip file */
+	if (write)
+		wb_start();
 	mode = MARK;                /* start of zip file signature sequence */
 	entries = 0;                /* entry count */
 	do {
@@ -719,9 +1155,64 @@ void sunzip(sunzip_file_in file, int write)
 			/* process compressed data */
 			if (flag & 1)
 				method = UINT_MAX;
+			queued = 0;
+#if UNZIP_THREADS > 1
+			if (method == 8 && !(flag & 8) && sunzip_out_valid(out->file) &&
+				!clen_hi && !ulen_hi && clen <= UNZIP_ENTRY && pool_start()) {
+				/* lengths are known: copy the entry out for a worker */
+				job = malloc(sizeof(struct job) + clen);
+				if (job == NULL)
+					bye("out of memory");
+				job->out.file = out->file;
+				job->crc = crc;
+				job->ulen = ulen;
+				job->clen = clen;
+				job->entry = entries;
+				job->here = here;
+				job->here_hi = here_hi;
+				tmpp = job->data;
+				tmp = clen;
+				while (tmp > left) {
+					memcpy(tmpp, next, left);
+					tmp -= left;
+					tmpp += left;
+					load(in);
+				}
+				memcpy(tmpp, next, tmp);
+				left -= (unsigned)tmp;
+				next += (unsigned)tmp;
+				pool_queue(job);
+				out->file = sunzip_out_invalid;
+				queued = 1;
+			}
+			else
+#endif
 			if (method == 0) {          /* stored */
 				if (clen != ulen || clen_hi != ulen_hi)
 					bye("zip file format error (stored lengths mismatch)");
+#if SUNZIP_DUMP
+				if (sunzip_out_valid(out->file) && !clen_hi && clen > left &&
+					clen - left >= DUMP_MIN) {
+					/* what was read already, then the rest in one go, after
+					   the ring has written its part */
+					put(out, next, left);
+					tmp = clen - left;
+					next += left;
+					left = 0;
+					if (wb_sync())
+						bye("write error");
+					if (sunzip_dump(out->file, tmp) != (long long)tmp)
+						bye("unexpected end of zip file");
+					in->count += tmp;
+					if (in->count < tmp)
+						in->count_hi++;
+					in->offset += tmp;
+					if (in->offset < tmp)
+						in->offset_hi++;
+					put_back(out, tmp, outbuf, 65536U);
+					clen = 0;
+				}
+#endif
 				while (clen_hi || clen > left) {
 					put(out, next, left);
 					if (clen < left) {
@@ -821,7 +1312,7 @@ void sunzip(sunzip_file_in file, int write)
 
 			/* close file, set file times */
 			if (sunzip_out_valid(out->file)) {
-				if (sunzip_closeout(out->file))
+				if (wb_close(out->file))
 					bye("write error");
 			  /*  times[0].tv_sec = acc;
 				times[0].tv_usec = 0;
@@ -879,9 +1370,10 @@ void sunzip(sunzip_file_in file, int write)
 				}
 			}
 
-			/* verify entry and display information (won't do if skipped) */
-			if (method == 0 || method == 8 || method == 9 || method == 10 ||
-				method == 12) {
+			/* verify entry and display information (won't do if skipped or
+			   queued, the pool reports those) */
+			if (!queued && (method == 0 || method == 8 || method == 9 ||
+							method == 10 || method == 12)) {
 				if (!GOOD()) {
 					bad("compressed data corrupted, check values mismatch",
 						entries, here, here_hi);
@@ -893,6 +1385,7 @@ void sunzip(sunzip_file_in file, int write)
 		case 0x02014b50UL:      /* central file header */
 			/* first time here: any earlier mode can arrive here */
 			if (mode < CENTRAL) {
+				pool_drain(1);
 					sunzip_printout("%lu entr%s processed\n",
 						   entries, entries == 1 ? "y" : "ies");
 				mode = CENTRAL;
@@ -984,6 +1477,9 @@ void sunzip(sunzip_file_in file, int write)
 #endif
 	if (strm != NULL)
 		inflateBackEnd(strm);
+	pool_end();
+	if (wb_end())
+		bye("write error");
 
 	/* check for junk */
 	if (left != 0 || get(in, NULL) != 0) {
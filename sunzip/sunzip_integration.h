@@ -9,6 +9,9 @@ sunzip_file_out sunzip_openout(const char *filename);
 //int sunzip_closeout(sunzip_file_out file);
 #define sunzip_closeout close
 int sunzip_read(sunzip_file_in file, void *buffer, size_t size);
+// moves len bytes of input straight into file, returns how many it moved
+long long sunzip_dump(sunzip_file_out file, long long len);
+#define SUNZIP_DUMP 1
 extern struct printbuffer_s sunzip_printb;
 void PB_PrintString( struct printbuffer_s *pb, const char *fmt, ... );
 #define sunzip_printout(...) PB_PrintString(&sunzip_printb, __VA_ARGS__)
@@ -13,7 +13,9 @@
 #include <limits.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <ctype.h>
 #include "zlib.h"
+#include "../include/crc32fold.h"
 #include "zipflow.h"
 
 // Maximum two and four-byte field values.
@@ -31,13 +33,70 @@
 #define O_BINARY 0
 #endif
 
+// Files of at least ZIP_TRIAL_MIN bytes whose names have no known extension
+// get a trial deflate of their first ZIP_TRIAL bytes, and are stored if that
+// does not save at least 1/ZIP_GAIN of them. Stored data goes to a registered
+// send() function in windows of ZIP_SEND bytes.
+#define ZIP_TRIAL (CHUNK < 65536 ? CHUNK : 65536)
+#ifndef ZIP_TRIAL_MIN
+#define ZIP_TRIAL_MIN 1048576
+#endif
+#ifndef ZIP_GAIN
+#define ZIP_GAIN 32
+#endif
+#ifndef ZIP_SEND
+#define ZIP_SEND (16 * CHUNK)
+#endif
+
+// Most deflate worker threads used for zip_entry(). Entries are compressed
+// concurrently on up to this many threads, limited to the number of online
+// processors. 0 or 1 compresses everything on the calling thread.
+#ifndef ZIP_THREADS
+#  ifdef _WIN32
+#    define ZIP_THREADS 0
+#  else
+#    define ZIP_THREADS 8
+#  endif
+#endif
+#if ZIP_THREADS > 1
+#  include <pthread.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#endif
+
+// Compressed bytes a worker may hold for an entry that is not yet being
+// written, and the number of entries that may be waiting to be written. This
+// bounds the memory used by the workers.
+#ifndef ZIP_QUEUE
+#define ZIP_QUEUE (4 * CHUNK)
+#endif
+#ifndef ZIP_PENDING
+#define ZIP_PENDING (2 * ZIP_THREADS)
+#endif
+
+// Files of at least ZIP_SPLIT bytes are cut into ZIP_BLOCK sized blocks that
+// are deflated on separate workers, each primed with the preceding ZIP_DICT
+// bytes, and joined into one deflate stream. At most ZIP_PARTS blocks of an
+// entry are taken but not yet written.
+#ifndef ZIP_BLOCK
+#define ZIP_BLOCK 1048576
+#endif
+#ifndef ZIP_SPLIT
+#define ZIP_SPLIT (4 * ZIP_BLOCK)
+#endif
+#ifndef ZIP_PARTS
+#define ZIP_PARTS (2 * ZIP_THREADS)
+#endif
+#define ZIP_DICT 32768
+
 // Information on each entry saved for the central directory. This takes up 64
 // to 72 bytes, plus the zero-terminated file name allocation for each entry.
 typedef struct {
     char *name;                 // path name (allocated)
     uint16_t nlen;              // path name length
     uint8_t os;                 // operating system (currently 3 or 10)
-    uint8_t spare;              // (structure padding)
+    uint8_t method;             // compression method (0 stored, 8 deflate)
+    uint8_t known;              // CRC-32 and lengths known before the data
     uint64_t ulen;              // uncompressed length
     uint64_t clen;              // compressed length
     uint32_t crc;               // CRC-32 of uncompressed data
@@ -55,6 +114,8 @@ typedef struct {
 typedef struct {
     void *handle;               // user opaque pointer for put() function
     int (*put)(void *, void const *, size_t);   // write streaming data
+    int (*send)(void *, int, int64_t, size_t);  // write file data, or NULL
+    int (*crc)(void *, int, uint64_t, uint32_t *);  // known CRC-32s, or NULL
     unsigned char *data;        // uncompressed deflate input buffer
     unsigned char *comp;        // compressed deflate output buffer
     uint64_t off;               // current offset in zip file
@@ -63,15 +124,19 @@ typedef struct {
     char omit;                  // true to omit entry in central directory
     char feed;                  // true if feeding data with zip_data()
     char level;                 // requested compression level
+    char precrc;                // true to write stored entries without descriptor
     size_t plen;                // path name length
     size_t pmax;                // path name allocation in bytes
     char *path;                 // current path (allocated)
+    int at;                     // directory holding the current file (Unix)
+    size_t base;                // offset of the file name in path (Unix)
     size_t hnum;                // number of headers
     size_t hmax;                // headers allocation count
     head_t *head;               // list of headers (allocated)
     void *hook;                 // user opaque pointer for log() function
     void (*log)(void *, char *);    // log function
     z_stream strm;              // re-useable deflate engine
+    struct zip_pool *pool;      // deflate workers, NULL until first needed
 } zip_t;
 
 #ifndef PREALLOC_PATH
@@ -132,6 +197,17 @@ static void zip_put(zip_t *zip, void const *ptr, size_t size) {
         zip->off += size;
 }
 
+// Write size bytes from offset off of the open file in to the zip file with
+// the registered send() function, without passing them through a buffer.
+static void zip_send(zip_t *zip, int in, uint64_t off, size_t size) {
+    if (zip->bad)
+        return;
+    if (zip->send(zip->handle, in, off, size))
+        zip->bad = 1;
+    else
+        zip->off += size;
+}
+
 // Allocate, initialize, and return a zip_t structure. Provide starting
 // allocations for the path and list of headers. Fire up the deflate engine,
 // using level for the compression level.
@@ -140,6 +216,8 @@ static ZIP *zip_init(int level) {
     assert(zip != NULL && "out of memory");
     zip->handle = NULL;
     zip->put = NULL;
+    zip->send = NULL;
+    zip->crc = NULL;
     zip->data = malloc(CHUNK);
     zip->comp = malloc(CHUNK);
     assert(zip->data != NULL && zip->comp != NULL && "out of memory");
@@ -149,6 +227,7 @@ static ZIP *zip_init(int level) {
     zip->omit = 0;
     zip->feed = 0;
     zip->level = level;
+    zip->precrc = 0;
     zip->plen = 0;
     zip->pmax = PREALLOC_PATH;
     zip->path = malloc(zip->pmax);
@@ -159,6 +238,7 @@ static ZIP *zip_init(int level) {
     assert(zip->head != NULL && "out of memory");
     zip->hook = NULL;
     zip->log = NULL;
+    zip->pool = NULL;
     zip->strm.zalloc = Z_NULL;
     zip->strm.zfree = Z_NULL;
     zip->strm.opaque = Z_NULL;
@@ -221,6 +301,11 @@ static void put_time(unsigned char *dos, time_t clock) {
      zip->level == 2 ? 4 : \
      zip->level == 1 ? 6 : 0)
 
+// General purpose bit flag for an entry. The level only applies to deflate,
+// and there is a data descriptor unless the CRC-32 and lengths were known.
+#define FLAGS(head) \
+    (0x800 + ((head)->known ? 0 : 8) + ((head)->method == 8 ? LEVEL() : 0))
+
 // Write a local header with the information in the last header slot.
 static void zip_local(zip_t *zip) {
     head_t const *head = zip->head + zip->hnum;
@@ -230,12 +315,15 @@ static void zip_local(zip_t *zip) {
     PUT4(hlocal, 0x04034b50);        // local file header signature
     PUT2(hlocal + 4,                 // version needed to extract (2.0 or 4.5)
          head->off >= MAX32 ? 45 : 20);
-    PUT2(hlocal + 6, 0x808 + LEVEL());   // UTF-8 name, level, data descriptor
-    PUT2(hlocal + 8, 8);             // deflate compression method
+    PUT2(hlocal + 6, FLAGS(head));   // UTF-8 name, level, data descriptor
+    PUT2(hlocal + 8, head->method);  // stored or deflate compression method
     put_time(hlocal + 10, head->mtime);  // modified time and date (4 bytes)
-    PUT4(hlocal + 14, 0);            // CRC-32 (in data descriptor)
-    PUT4(hlocal + 18, 0);            // compressed size (in data descriptor)
-    PUT4(hlocal + 22, 0);            // uncompressed size (in data descriptor)
+    PUT4(hlocal + 14,                // CRC-32 (or in data descriptor)
+         head->known ? head->crc : 0);
+    PUT4(hlocal + 18,                // compressed size (or in data descriptor)
+         head->known ? head->clen : 0);
+    PUT4(hlocal + 22,                // uncompressed size (or in data descriptor)
+         head->known ? head->ulen : 0);
     PUT2(hlocal + 26, head->nlen);   // file name length (name follows header)
     PUT2(hlocal + 28, 0);            // extra field length
 
@@ -263,7 +351,7 @@ static void zip_deflate(zip_t *zip, int in) {
             zip->strm.avail_in = r>0?r:0;
             zip->strm.next_in = zip->data;
             head->ulen += zip->strm.avail_in;
-            head->crc = crc32(head->crc, zip->data, zip->strm.avail_in);
+            head->crc = S_Crc32(head->crc, zip->data, zip->strm.avail_in);
             if (zip->strm.avail_in < CHUNK) {
                 eof = 1;
                 if (r < 0) {
@@ -285,6 +373,127 @@ static void zip_deflate(zip_t *zip, int in) {
     deflateReset(&zip->strm);       // prepare for next use of engine
 }
 
+// Extensions of formats that are compressed already, in lower case.
+static char const *const zip_packed[] = {
+    "7z", "aac", "apk", "avi", "avif", "br", "bz2", "docx", "epub", "flac",
+    "gif", "gz", "heic", "jar", "jpeg", "jpg", "lz", "lz4", "lzma", "m4a",
+    "m4v", "mkv", "mov", "mp3", "mp4", "odt", "ogg", "opus", "png", "pptx",
+    "rar", "tgz", "txz", "webm", "webp", "xlsx", "xz", "zip", "zst", NULL
+};
+
+// Return the compression method for the entry in the last header slot, whose
+// open input file is in: 0 to store it, or 8 to deflate it. The trial uses the
+// deflate engine in zip->strm, and leaves in at the start of the file.
+static int zip_method(zip_t *zip, int in) {
+    if (zip->level == 0)
+        return 0;                   // deflate would only make stored blocks
+
+    // Store names with the extension of a compressed format.
+    head_t const *head = zip->head + zip->hnum;
+    char const *dot = strrchr(head->name, '.');
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        char ext[8];
+        size_t n = 0;
+        while (dot[n + 1] && n < sizeof(ext) - 1) {
+            ext[n] = tolower((unsigned char)dot[n + 1]);
+            n++;
+        }
+        ext[n] = 0;
+        for (char const *const *p = zip_packed; dot[n + 1] == 0 && *p; p++)
+            if (strcmp(*p, ext) == 0)
+                return 0;
+    }
+
+    // Try deflating the start of a large file.
+    off_t size = lseek(in, 0, SEEK_END);
+    if (lseek(in, 0, SEEK_SET) != 0 || size < ZIP_TRIAL_MIN)
+        return 8;
+    ssize_t got = read(in, zip->data, ZIP_TRIAL);
+    if (lseek(in, 0, SEEK_SET) != 0 || got < ZIP_TRIAL)
+        return 8;
+    zip->strm.next_in = zip->data;
+    zip->strm.avail_in = got;
+    zip->strm.next_out = zip->comp;
+    zip->strm.avail_out = CHUNK;
+    int ret = deflate(&zip->strm, Z_FINISH);
+    size_t len = CHUNK - zip->strm.avail_out;
+    deflateReset(&zip->strm);
+    return ret == Z_STREAM_END && len < got - got / ZIP_GAIN ? 8 : 0;
+}
+
+// Set the CRC-32 and lengths of the stored entry in the last header slot
+// before it is written, from the registered crc() function or from a pass over
+// the open file in, which is left at its start. The entry keeps its data
+// descriptor if that fails, or if the file is too large for the local header.
+static void zip_precrc(zip_t *zip, int in) {
+    head_t *head = zip->head + zip->hnum;
+    off_t size = lseek(in, 0, SEEK_END);
+    if (lseek(in, 0, SEEK_SET) != 0 || size < 0 || size >= MAX32)
+        return;
+    uint32_t crc;
+    if (zip->crc == NULL || zip->crc(zip->handle, in, size, &crc)) {
+        crc = crc32(0, Z_NULL, 0);
+        uint64_t got = 0;
+        ssize_t r;
+        while ((r = read(in, zip->data, CHUNK)) > 0) {
+            crc = S_Crc32(crc, zip->data, r);
+            got += r;
+        }
+        if (lseek(in, 0, SEEK_SET) != 0 || r < 0 || got != (uint64_t)size)
+            return;
+    }
+    head->crc = crc;
+    head->ulen = head->clen = size;
+    head->known = 1;
+}
+
+// Copy the file in to the zip file as a stored entry, setting the lengths and
+// CRC-32 in the header slot like zip_deflate(). With a registered send()
+// function, the data is only read here for the CRC-32, and goes out straight
+// from the file. If the CRC-32 is known already, it isn't read at all, and
+// otherwise it is checked against what was read.
+static void zip_store(zip_t *zip, int in) {
+    head_t *head = zip->head + zip->hnum;
+    if (head->known && zip->send != NULL) {
+        if (head->ulen)
+            zip_send(zip, in, 0, head->ulen);
+        return;
+    }
+    uint64_t want = head->ulen;
+    uint32_t check = head->crc;
+    head->ulen = 0;
+    head->crc = crc32(0, Z_NULL, 0);
+    size_t window = zip->send != NULL ? ZIP_SEND : CHUNK;
+    int eof = 0;
+    while (!eof && !zip->bad) {
+        size_t have = 0;
+        while (have < window) {
+            ssize_t r = read(in, zip->data, CHUNK);
+            if (r <= 0) {
+                eof = 1;
+                if (r < 0) {
+                    warn("read error on %s: %s -- entry omitted",
+                         head->name, strerror(errno));
+                    zip->omit = 1;  // finish, but omit from directory
+                }
+                break;
+            }
+            head->crc = S_Crc32(head->crc, zip->data, r);
+            if (zip->send == NULL)
+                zip_put(zip, zip->data, r);
+            have += r;
+        }
+        if (zip->send != NULL && have)
+            zip_send(zip, in, head->ulen, have);
+        head->ulen += have;
+    }
+    head->clen = head->ulen;
+    if (head->known && (head->ulen != want || head->crc != check)) {
+        warn("%s changed while zipping -- entry omitted", head->name);
+        zip->omit = 1;              // the local header is wrong
+    }
+}
+
 // Write a data descriptor with the information in the last header slot. The
 // descriptor can use either 32-bit or 64-bit fields for the compressed and
 // uncompressed lengths. The size must be determined by the same logic that
@@ -318,6 +527,433 @@ static void zip_next(zip_t *zip) {
     }
 }
 
+#if ZIP_THREADS > 1
+// Parallel compression. zip_file() hands each opened entry to a pool of
+// worker threads, each with its own deflate engine. A worker compresses into
+// a list of CHUNK sized blocks. The calling thread writes the entries strictly
+// in the order they were queued: the local header, the blocks as they arrive,
+// and the data descriptor. Workers take entries in that same order, so the
+// entry being written always has a worker, and a worker that gets ahead of the
+// output waits once it holds ZIP_QUEUE bytes.
+//
+// A large file is instead split into parts, taken by workers one by one like
+// pigz does. Each part but the last ends with a sync flush, so the compressed
+// parts simply concatenate into one deflate stream, and their CRC-32s are
+// joined with crc32_combine(). Deflating a part never waits for the writer,
+// so the parts of the entry being written are always completed.
+
+// Compressed data waiting to be written.
+typedef struct zip_block {
+    struct zip_block *next;
+    size_t len;
+    unsigned char data[CHUNK];
+} zip_block_t;
+
+// A compressed part of a large file.
+typedef struct zip_part {
+    uint64_t ulen;              // uncompressed length
+    uint32_t crc;               // CRC-32 of the uncompressed part
+    int err;                    // errno of a read error, or 0
+    size_t len;                 // compressed length
+    unsigned char data[];       // compressed data
+} zip_part_t;
+
+// An entry being compressed by a worker. Workers never touch zip->head, which
+// can move when it grows, so the entry carries its own copy of the metadata.
+typedef struct zip_job {
+    struct zip_job *next;       // next entry in output order
+    head_t head;                // metadata, read only while queued
+    uint64_t ulen;              // uncompressed length, final when done
+    uint64_t clen;              // compressed length, final when done
+    uint32_t crc;               // CRC-32 of uncompressed data, final when done
+    int in;                     // input file, closed by the worker
+    int err;                    // errno of a read error, or 0
+    int done;                   // compression is complete
+    zip_block_t *first, *last;  // compressed blocks not yet written
+    size_t queued;              // bytes in those blocks
+    uint64_t parts;             // number of parts, 0 to deflate as one stream
+    uint64_t taken;             // parts taken by workers
+    uint64_t written;           // parts written
+    zip_part_t *ring[ZIP_PARTS];    // completed parts, by index % ZIP_PARTS
+} zip_job_t;
+
+typedef struct zip_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // for workers: new entry, or quit
+    pthread_cond_t room;        // for workers: blocks were written
+    pthread_cond_t ready;       // for the writer: new block or entry done
+    zip_job_t *head, *tail;     // entries not yet written, in order
+    zip_job_t *take;            // first entry not yet taken by a worker
+    int pending;                // number of entries in head list
+    int abandon;                // write error, stop compressing
+    int quit;                   // workers exit
+    int threads;                // number of workers
+    pthread_t tid[ZIP_THREADS];
+} zip_pool_t;
+
+// Add a compressed block to job, waiting while the job already holds enough.
+// The block is dropped if the output has failed. Called with the lock held.
+static void zip_job_put(zip_pool_t *pool, zip_job_t *job, zip_block_t *blk) {
+    while (job->queued >= ZIP_QUEUE && !pool->abandon)
+        pthread_cond_wait(&pool->room, &pool->lock);
+    if (pool->abandon) {
+        free(blk);
+        return;
+    }
+    blk->next = NULL;
+    if (job->last == NULL)
+        job->first = blk;
+    else
+        job->last->next = blk;
+    job->last = blk;
+    job->queued += blk->len;
+    pthread_cond_broadcast(&pool->ready);
+}
+
+// Compress job->in with strm, like zip_deflate() but into blocks.
+static void zip_job_deflate(zip_pool_t *pool, zip_job_t *job, z_stream *strm,
+                            unsigned char *data) {
+    job->ulen = 0;
+    job->clen = 0;
+    job->crc = crc32(0, Z_NULL, 0);
+    strm->avail_in = 0;
+    int eof = 0, ret;
+    do {
+        if (strm->avail_in == 0 && !eof) {
+            ssize_t r = read(job->in, data, CHUNK);
+            strm->avail_in = r > 0 ? r : 0;
+            strm->next_in = data;
+            job->ulen += strm->avail_in;
+            job->crc = S_Crc32(job->crc, data, strm->avail_in);
+            if (strm->avail_in < CHUNK) {
+                eof = 1;
+                if (r < 0)
+                    job->err = errno;
+            }
+        }
+        zip_block_t *blk = malloc(sizeof(zip_block_t));
+        assert(blk != NULL && "out of memory");
+        strm->avail_out = CHUNK;
+        strm->next_out = blk->data;
+        ret = deflate(strm, eof ? Z_FINISH : Z_NO_FLUSH);
+        blk->len = CHUNK - strm->avail_out;
+        job->clen += blk->len;
+        pthread_mutex_lock(&pool->lock);
+        if (blk->len)
+            zip_job_put(pool, job, blk);
+        else
+            free(blk);
+        int abandon = pool->abandon;
+        pthread_mutex_unlock(&pool->lock);
+        if (abandon)
+            break;                  // the result won't be going anywhere
+    } while (ret == Z_OK);
+    deflateReset(strm);
+}
+
+// Deflate part idx of job into a new allocation. data has room for the part
+// and the dictionary before it. The last part completes the deflate stream.
+static zip_part_t *zip_part_deflate(zip_job_t *job, uint64_t idx,
+                                    z_stream *strm, unsigned char *data) {
+    size_t dict = idx ? ZIP_DICT : 0;
+    ssize_t got = pread(job->in, data, dict + ZIP_BLOCK,
+                        (off_t)idx * ZIP_BLOCK - dict);
+    int err = got < 0 ? errno : 0;
+    if (got < 0)
+        got = 0;
+    if ((size_t)got < dict)
+        dict = got;                 // the file shrank
+    size_t have = got - dict;
+    int last = idx + 1 == job->parts;
+
+    if (dict)
+        deflateSetDictionary(strm, data, dict);
+    size_t bound = deflateBound(strm, have) + 16;   // room for a sync flush
+    zip_part_t *part = malloc(sizeof(zip_part_t) + bound);
+    assert(part != NULL && "out of memory");
+    part->ulen = have;
+    part->crc = S_Crc32(crc32(0, Z_NULL, 0), data + dict, have);
+    part->err = err;
+    strm->next_in = data + dict;
+    strm->avail_in = have;
+    strm->next_out = part->data;
+    strm->avail_out = bound;
+    int ret = deflate(strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    assert(ret == (last ? Z_STREAM_END : Z_OK) && strm->avail_in == 0 &&
+           "internal error");
+    part->len = bound - strm->avail_out;
+    deflateReset(strm);             // prepare for next use of engine
+    return part;
+}
+
+// Worker thread: compress entries in the order they were queued.
+static void *zip_worker(void *arg) {
+    zip_t *zip = arg;
+    zip_pool_t *pool = zip->pool;
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    int ret = deflateInit2(&strm, zip->level, Z_DEFLATED, -15, 8,
+                           Z_DEFAULT_STRATEGY);     // raw deflate
+    unsigned char *data = malloc(ZIP_DICT + ZIP_BLOCK);
+    assert(ret == Z_OK && data != NULL && "out of memory");
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->take == NULL && !pool->quit)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->take == NULL)
+            break;
+        zip_job_t *job = pool->take;
+        if (job->head.method == 0) {
+            // Stored entries are copied by the writer.
+            pool->take = job->next;
+            job->done = 1;
+            pthread_cond_broadcast(&pool->ready);
+            continue;
+        }
+        if (job->parts) {
+            // Take the next part of a large file, once there is room for it.
+            if (job->taken - job->written >= ZIP_PARTS) {
+                pthread_cond_wait(&pool->room, &pool->lock);
+                continue;
+            }
+            uint64_t idx = job->taken++;
+            if (job->taken == job->parts)
+                pool->take = job->next;
+            int abandon = pool->abandon;
+            pthread_mutex_unlock(&pool->lock);
+
+            zip_part_t *part = abandon ? calloc(1, sizeof(zip_part_t)) :
+                                         zip_part_deflate(job, idx, &strm, data);
+            assert(part != NULL && "out of memory");
+
+            pthread_mutex_lock(&pool->lock);
+            job->ring[idx % ZIP_PARTS] = part;
+            pthread_cond_broadcast(&pool->ready);
+            continue;
+        }
+        pool->take = job->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        zip_job_deflate(pool, job, &strm, data);
+        close(job->in);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    deflateEnd(&strm);
+    free(data);
+    return NULL;
+}
+
+// Start the workers. Return false if there is no point, leaving zip->pool
+// NULL so that entries are compressed serially.
+static int zip_pool_start(zip_t *zip) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 2)
+        return 0;
+    zip_pool_t *pool = malloc(sizeof(zip_pool_t));
+    assert(pool != NULL && "out of memory");
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->room, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pool->head = pool->tail = pool->take = NULL;
+    pool->pending = 0;
+    pool->abandon = 0;
+    pool->quit = 0;
+    pool->threads = 0;
+    zip->pool = pool;
+    while (pool->threads < (cpus < ZIP_THREADS ? cpus : ZIP_THREADS) &&
+           pthread_create(pool->tid + pool->threads, NULL, zip_worker,
+                          zip) == 0)
+        pool->threads++;
+    return pool->threads != 0;
+}
+
+// Write the oldest queued entry to the zip file, waiting for its worker as
+// needed. This runs on the calling thread, the only one that calls zip_put().
+static void zip_pool_write(zip_t *zip) {
+    zip_pool_t *pool = zip->pool;
+    zip_job_t *job = pool->head;
+
+    // Set up the header slot and write the local header.
+    zip_next(zip);
+    head_t *head = zip->head + zip->hnum;
+    *head = job->head;
+    head->off = zip->off;
+    zip_local(zip);
+
+    // Write the compressed parts in order as they complete, combining their
+    // CRC-32s. The writer closes the input, which all the workers share.
+    pthread_mutex_lock(&pool->lock);
+    if (job->head.method == 0) {
+        // Copy a stored entry here, taking it from the workers if none has.
+        if (pool->take == job) {
+            pool->take = job->next;
+            job->done = 1;
+        }
+        while (!job->done)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        zip_store(zip, job->in);
+        close(job->in);
+        job->crc = head->crc;
+        job->ulen = head->ulen;
+        job->clen = head->clen;
+        pthread_mutex_lock(&pool->lock);
+        if (zip->bad && !pool->abandon) {
+            pool->abandon = 1;
+            pthread_cond_broadcast(&pool->room);
+        }
+    }
+    else if (job->parts) {
+        job->crc = crc32(0, Z_NULL, 0);
+        job->ulen = job->clen = 0;
+        while (job->written < job->parts) {
+            zip_part_t **slot = job->ring + job->written % ZIP_PARTS;
+            while (*slot == NULL)
+                pthread_cond_wait(&pool->ready, &pool->lock);
+            zip_part_t *part = *slot;
+            *slot = NULL;
+            job->written++;
+            pthread_cond_broadcast(&pool->room);
+            pthread_mutex_unlock(&pool->lock);
+            zip_put(zip, part->data, part->len);
+            job->crc = crc32_combine(job->crc, part->crc, part->ulen);
+            job->ulen += part->ulen;
+            job->clen += part->len;
+            if (part->err)
+                job->err = part->err;
+            free(part);
+            pthread_mutex_lock(&pool->lock);
+            if (zip->bad)
+                pool->abandon = 1;
+        }
+        close(job->in);
+        job->done = 1;
+    }
+
+    // Write the compressed blocks as they arrive, there are none for parts.
+    for (;;) {
+        while (job->first == NULL && !job->done)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        zip_block_t *blk = job->first;
+        if (blk == NULL)
+            break;
+        job->first = blk->next;
+        if (job->first == NULL)
+            job->last = NULL;
+        job->queued -= blk->len;
+        pthread_cond_broadcast(&pool->room);
+        pthread_mutex_unlock(&pool->lock);
+        zip_put(zip, blk->data, blk->len);
+        free(blk);
+        pthread_mutex_lock(&pool->lock);
+        if (zip->bad && !pool->abandon) {
+            pool->abandon = 1;      // stop compressing on write error
+            pthread_cond_broadcast(&pool->room);
+        }
+    }
+    pool->head = job->next;
+    if (pool->head == NULL)
+        pool->tail = NULL;
+    pool->pending--;
+    pthread_mutex_unlock(&pool->lock);
+
+    // Complete the entry with the final CRC-32 and lengths.
+    head->crc = job->crc;
+    head->ulen = job->ulen;
+    head->clen = job->clen;
+    if (job->err) {
+        warn("read error on %s: %s -- entry omitted", head->name,
+             strerror(job->err));
+        zip->omit = 1;              // finish, but omit from directory
+    }
+    if (!head->known)
+        zip_desc(zip);
+    if (zip->omit) {
+        free(head->name);
+        zip->omit = 0;
+    }
+    else
+        zip->hnum++;
+    free(job);
+}
+
+// Queue the entry in the last header slot, with its open input file in, for
+// compression by the workers. Write queued entries while too many are waiting.
+static void zip_pool_queue(zip_t *zip, int in) {
+    zip_pool_t *pool = zip->pool;
+    zip_job_t *job = malloc(sizeof(zip_job_t));
+    assert(job != NULL && "out of memory");
+    job->next = NULL;
+    job->head = zip->head[zip->hnum];   // before writing reuses the slot
+    job->in = in;
+    job->err = 0;
+    job->done = 0;
+    job->first = job->last = NULL;
+    job->queued = 0;
+    job->parts = job->taken = job->written = 0;
+    memset(job->ring, 0, sizeof(job->ring));
+    struct stat st;
+    if (job->head.method == 8 && pool->threads > 1 && fstat(in, &st) == 0 &&
+        st.st_size >= ZIP_SPLIT)
+        job->parts = (st.st_size + ZIP_BLOCK - 1) / ZIP_BLOCK;
+
+    while (pool->pending >= ZIP_PENDING)
+        zip_pool_write(zip);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail == NULL)
+        pool->head = job;
+    else
+        pool->tail->next = job;
+    pool->tail = job;
+    if (pool->take == NULL)
+        pool->take = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Write all queued entries.
+static void zip_pool_flush(zip_t *zip) {
+    if (zip->pool != NULL)
+        while (zip->pool->pending)
+            zip_pool_write(zip);
+}
+
+// Stop the workers. All entries must have been written.
+static void zip_pool_stop(zip_t *zip) {
+    zip_pool_t *pool = zip->pool;
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    while (pool->threads)
+        pthread_join(pool->tid[--pool->threads], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->room);
+    pthread_cond_destroy(&pool->ready);
+    free(pool);
+    zip->pool = NULL;
+}
+#else
+#  define zip_pool_flush(zip)
+#  define zip_pool_stop(zip)
+#endif
+
+// Open the current file for reading, operating system dependent.
+static int zip_open_in(zip_t *zip);
+
 // Write an entry to the zip file. zip->path is the name of a regular file. The
 // operating system and associated file attributes have already been stored at
 // zip->head[zip->hnum]. This writes the local header, the compressed data, and
@@ -332,7 +968,7 @@ static void zip_file(zip_t *zip) {
 
     // Make sure we can open it for reading first. We know it's there, but
     // perhaps we don't have permission to read it.
-    int in = open(zip->path, O_RDONLY | O_BINARY);
+    int in = zip_open_in(zip);
     if (in < 0) {
         warn("could not open %s for reading: %s -- skipping", zip->path, strerror(errno));
         return;
@@ -347,16 +983,32 @@ static void zip_file(zip_t *zip) {
     memcpy(head->name, zip->path, zip->plen + 1);
     head->nlen = zip->plen;
     head->off = zip->off;
+    head->method = zip_method(zip, in);
+    head->known = 0;
+    if (head->method == 0 && zip->precrc)
+        zip_precrc(zip, in);
+
+#if ZIP_THREADS > 1
+    // Hand the entry to the workers, unless there are none.
+    if (zip->pool != NULL || zip_pool_start(zip)) {
+        zip_pool_queue(zip, in);
+        return;
+    }
+#endif
 
-    // Write the local header, compressed data, and data descriptor, and update
-    // the entry count. zip_deflate() sets the CRC-32 and lengths in the header
-    // structure. If there is a read error on in, the entry is completed with
+    // Write the local header, compressed or stored data, and data descriptor,
+    // and update the entry count. zip_deflate() or zip_store() sets the CRC-32
+    // and lengths in the header structure. If there is a read error on in, the entry is completed with
     // the data read up to the error, but the entry is omitted from the central
     // directory.
     zip_local(zip);
-    zip_deflate(zip, in);
+    if (head->method == 8)
+        zip_deflate(zip, in);
+    else
+        zip_store(zip, in);
     close(in);
-    zip_desc(zip);
+    if (!head->known)
+        zip_desc(zip);
     if (zip->omit) {
         free(head->name);
         zip->omit = 0;
@@ -388,6 +1040,10 @@ static void zip_room(zip_t *zip, size_t want) {
 #  include <windows.h>
 #  include <locale.h>
 #  define OS 10
+static int zip_open_in(zip_t *zip) {
+    return open(zip->path, O_RDONLY | O_BINARY);
+}
+
 static void zip_scan(zip_t *zip) {
     // Get the metadata for the object named zip->path. We need to open the
     // object in case it's a symbolic link.
@@ -473,9 +1129,78 @@ static void zip_scan(zip_t *zip) {
     zip_file(zip);
 }
 #else   // Unix (assumes POSIX compatible)
+#  include <unistd.h>
 #  include <sys/stat.h>
-#  include <dirent.h>
+#  include "../include/dirscan.h"
 #  define OS 3
+// The file is opened relative to its directory, without walking the path.
+static int zip_open_in(zip_t *zip) {
+    return openat(zip->at, zip->path + zip->base, O_RDONLY);
+}
+
+// Add the regular file zip->path with the metadata in st.
+static void zip_scan_file(zip_t *zip, struct stat const *st) {
+    // Assure that there is room in the header list to add an entry.
+    zip_next(zip);
+    head_t *head = zip->head + zip->hnum;
+    head->os = OS;
+    head->mode = (uint32_t)st->st_mode << 16;
+    head->atime = st->st_atime;
+    head->mtime = st->st_mtime;
+    zip_file(zip);
+}
+
+// Add the entries of the open directory dir, which is named zip->path. Entry
+// types come from the directory itself where the file system provides them,
+// and metadata is read relative to dir, so no path is looked up again.
+static void zip_scan_dir(zip_t *zip, dirscan_t *dir) {
+    size_t len = zip->plen;
+    zip->path[len] = '/';
+    dirscan_ent_t *dp;
+    while ((dp = D_Next(dir)) != NULL) {
+        // Append a slash and the name to zip->path.
+        char const *name = dp->d_name;
+        size_t nlen = strlen(name);
+        zip_room(zip, len + 1 + nlen + 1);
+        memcpy(zip->path + len + 1, name, nlen + 1);
+        zip->plen = len + 1 + nlen;
+
+        struct stat st;
+        int statted;
+        int type = D_Type(dir, dp, &st, &statted);
+        if (type == DT_DIR) {
+            // Recursively process the subdirectory. Its scan buffer is
+            // allocated, deep trees would not fit on the stack.
+            dirscan_t *sub = malloc(sizeof(dirscan_t));
+            assert(sub != NULL && "out of memory");
+            if (D_OpenAt(sub, dir->fd, name)) {
+                zip_scan_dir(zip, sub);
+                D_Close(sub);
+            }
+            else
+                warn("could not open directory %s -- skipping", zip->path);
+            free(sub);
+        }
+        else if (type == DT_REG) {
+            // A regular file, or a symbolic link to one.
+            if (!statted && D_Stat(dir, name, &st)) {
+                warn("could not stat %s -- skipping", zip->path);
+                continue;
+            }
+            zip->at = dir->fd;
+            zip->base = len + 1;
+            zip_scan_file(zip, &st);
+        }
+        else
+            // zip->path may be a device, pipe, or socket.
+            warn("%s is not a file or directory -- skipping", zip->path);
+    }
+
+    // Restore zip->path to what it was.
+    zip->path[len] = 0;
+    zip->plen = len;
+}
+
 static void zip_scan(zip_t *zip) {
     // Get the metadata for the object named zip->path.
     struct stat st;
@@ -487,32 +1212,15 @@ static void zip_scan(zip_t *zip) {
 
     if (S_ISDIR(st.st_mode)) {
         // zip->path is a directory. Open and traverse the directory.
-        DIR *dir = opendir(zip->path);
-        if (dir == NULL) {
-            warn("could not open directory %s -- skipping", zip->path);
-            return;
+        dirscan_t *dir = malloc(sizeof(dirscan_t));
+        assert(dir != NULL && "out of memory");
+        if (D_OpenAt(dir, AT_FDCWD, zip->path)) {
+            zip_scan_dir(zip, dir);
+            D_Close(dir);
         }
-        size_t len = zip->plen;
-        zip->path[len] = '/';
-        struct dirent *dp;
-        while ((dp = readdir(dir)) != NULL) {
-            char const *name = dp->d_name;
-            if (name[0] == '.' && (name[1] == 0 ||
-                                   (name[1] == '.' && name[2] == 0)))
-                continue;           // ignore . and .. directories
-            // Append a slash and the name to zip->path. Recursively process
-            // the new zip->path.
-            size_t nlen = strlen(name);
-            zip_room(zip, len + 1 + nlen + 1);
-            memcpy(zip->path + len + 1, name, nlen + 1);
-            zip->plen = len + 1 + nlen;
-            zip_scan(zip);
-        }
-        closedir(dir);
-
-        // Restore zip->path to what it was.
-        zip->path[len] = 0;
-        zip->plen = len;
+        else
+            warn("could not open directory %s -- skipping", zip->path);
+        free(dir);
         return;
     }
 
@@ -524,14 +1232,9 @@ static void zip_scan(zip_t *zip) {
 
     // zip->path is a regular file, or a symbolic link to one. zip it,
     // providing the associated file metadata to include in the zip file.
-    // Assure that there is room in the header list to add an entry.
-    zip_next(zip);
-    head_t *head = zip->head + zip->hnum;
-    head->os = OS;
-    head->mode = (uint32_t)st.st_mode << 16;
-    head->atime = st.st_atime;
-    head->mtime = st.st_mtime;
-    zip_file(zip);
+    zip->at = AT_FDCWD;
+    zip->base = 0;
+    zip_scan_file(zip, &st);
 }
 #endif
 
@@ -590,8 +1293,8 @@ static void zip_central(zip_t *zip, head_t const *head) {
     PUT2(central + 4,               // os, made by v4.5 equivalent
          ((unsigned)head->os << 8) + 45);
     PUT2(central + 6, zlen ? 45 : 20);  // version needed to extract
-    PUT2(central + 8, 0x808 + LEVEL()); // UTF-8 name, level, data descriptor
-    PUT2(central + 10, 8);          // deflate compression method
+    PUT2(central + 8, FLAGS(head)); // UTF-8 name, level, data descriptor
+    PUT2(central + 10, head->method);   // stored or deflate compression method
     put_time(central + 12, head->mtime);    // modified time and date (4 bytes)
     PUT4(central + 16, head->crc);  // CRC-32
     PUT4(central + 20,              // compressed length
@@ -668,6 +1371,7 @@ static void zip_end(zip_t *zip, uint64_t beg) {
 
 // Free all allocated memory. Return true if a write error was noted.
 static int zip_clean(zip_t *zip) {
+    zip_pool_stop(zip);
     deflateEnd(&zip->strm);
     while (zip->hnum)
         free(zip->head[--zip->hnum].name);
@@ -702,6 +1406,25 @@ int zip_log(ZIP *ptr, void *hook, void (*log)(void *, char *)) {
     return 0;
 }
 
+// See comments in zipflow.h.
+int zip_sendfile(ZIP *ptr, int (*send)(void *, int, int64_t, size_t)) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID)
+        return -1;
+    zip->send = send;
+    return 0;
+}
+
+// See comments in zipflow.h.
+int zip_crc(ZIP *ptr, int on, int (*crc)(void *, int, uint64_t, uint32_t *)) {
+    zip_t *zip = (zip_t *)ptr;
+    if (zip == NULL || zip->id != ID)
+        return -1;
+    zip->precrc = on != 0;
+    zip->crc = crc;
+    return 0;
+}
+
 // See comments in zipflow.h.
 int zip_entry(ZIP *ptr, char const *path) {
     zip_t *zip = (zip_t *)ptr;
@@ -712,6 +1435,7 @@ int zip_entry(ZIP *ptr, char const *path) {
     memcpy(zip->path, path, len + 1);
     zip->plen = len;
     zip_scan(zip);
+    zip_pool_flush(zip);
     return zip->bad;
 }
 
@@ -756,6 +1480,8 @@ int zip_meta(ZIP *ptr, char const *path, int os, ...) {
 
     // Set up for writing the entry with zip_data().
     head->off = zip->off;
+    head->method = 8;
+    head->known = 0;
     head->ulen = 0;
     head->clen = 0;
     head->crc = crc32(0, Z_NULL, 0);
@@ -782,7 +1508,7 @@ int zip_data(ZIP *ptr, void const *data, size_t len, int last) {
     // Update the CRC-32 and uncompressed length.
     head_t *head = zip->head + zip->hnum;
     if (len) {
-        head->crc = crc32_z(head->crc, data, len);
+        head->crc = S_Crc32(head->crc, data, len);
         head->ulen += len;
     }
 
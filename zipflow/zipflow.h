@@ -106,6 +106,12 @@
 // plus the average length of a file name, multiplied by the number of entries
 // in the resulting zip file. The small constant is 64 to 72 bytes plus the
 // null termination and allocation overhead for the file name.
+//
+// zip_entry() compresses files on up to ZIP_THREADS worker threads when more
+// than one processor is online. The output is identical in order and format.
+// Each worker adds its own deflate engine and buffers, and each of the at most
+// ZIP_PENDING entries waiting to be written holds up to ZIP_QUEUE compressed
+// bytes, so memory use stays bounded.
 
 #include <unistd.h>
 #include <stdio.h>
@@ -143,6 +149,29 @@ ZIP *zip_pipe(void *handle,
 // is returned.
 int zip_log(ZIP *zip, void *hook, void (*log)(void *hook, char *msg));
 
+// Register the function send() to write the data of stored entries straight
+// from the file, e.g. with sendfile(), instead of through put(). send() writes
+// the len bytes at offset off of the open file fd, and returns 0 on success or
+// 1 to abort the streaming, like put(). zip_entry() stores files instead of
+// deflating them when the name has the extension of a compressed format, or
+// when a trial deflate of the start of a large file saves next to nothing.
+// The previous send() function can be unregistered by passing NULL. On
+// success, 0 is returned. If zip is not valid, then -1 is returned.
+int zip_sendfile(ZIP *zip, int (*send)(void *handle, int fd, int64_t off,
+                                       size_t len));
+
+// If on is true, write stored entries with the CRC-32 and lengths in the local
+// header and no data descriptor, for readers that mishandle descriptors. The
+// CRC-32 is asked from crc() if registered, which returns 0 and sets *crc for
+// the len bytes of the open file fd if it knows them, e.g. from a cache, or 1
+// if not. Otherwise it is computed with a pass over the file before the entry
+// is written. A stored entry with a known CRC-32 is then sent without being
+// read again when send() is registered. Files of 4 GiB or more keep their data
+// descriptor. On success, 0 is returned. If zip is not valid, then -1 is
+// returned.
+int zip_crc(ZIP *zip, int on, int (*crc)(void *handle, int fd, uint64_t len,
+                                         uint32_t *crc));
+
 // Add an entry to the zip file with the file path, or entries to the zip file
 // with any files contained at any level in the directory path. On success, 0
 // is returned. If zip is not valid, then -1 is returned. If there is a write